@@ -0,0 +1,52 @@
+#ifndef BENCH_ALLOC_COUNT_HPP
+#define BENCH_ALLOC_COUNT_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/**
+ * Replaces the global operator new to count heap allocations and the
+ * bytes they hold. Include this in exactly one file per benchmark.
+ *
+ * The byte count is what callers asked for, leaving out the
+ * allocator's own overhead per block.
+ */
+
+// Atomic, since parallel loads allocate from several threads:
+static std::atomic<size_t> live_bytes(0);
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    auto block = static_cast<size_t*>(std::malloc(size + sizeof(max_align_t)));
+    if (!block)
+        throw std::bad_alloc();
+    *block = size;
+    live_bytes += size;
+    ++allocations;
+    return reinterpret_cast<char*>(block) + sizeof(max_align_t);
+}
+
+void operator delete(void* data) noexcept
+{
+    if (!data)
+        return;
+
+    // Stepping back as an integer keeps the compiler from checking the
+    // step against the caller's own type, once this is inlined:
+    auto block = reinterpret_cast<size_t*>(
+        reinterpret_cast<uintptr_t>(data) - sizeof(max_align_t));
+    live_bytes -= *block;
+    std::free(block);
+}
+
+// Sized deletes must go the same way, where the compiler makes them:
+void operator delete(void* data, size_t) noexcept
+{
+    operator delete(data);
+}
+
+#endif
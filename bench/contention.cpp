@@ -0,0 +1,144 @@
+/**
+ * Measures tx_db query throughput as the number of reader threads grows,
+ * both alone and alongside a writer thread inserting transactions.
+ * With shared read locks, throughput should scale with the readers.
+ *
+ * It then saves the database over and over alongside the writer, in
+ * each of the ways there are, and counts how often the writer had to
+ * copy the whole table because a save still held it. That should be
+ * never, except for stream, which saves from a snapshot to keep a
+ * second copy of the rows out of memory.
+ */
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "wallet.hpp"
+
+constexpr size_t addresses = 100;
+constexpr size_t transactions = 10000;
+constexpr double run_seconds = 1.0;
+
+static bc::transaction_type make_tx(uint32_t i)
+{
+    bc::transaction_type tx;
+    tx.version = 1;
+    tx.locktime = i;
+    tx.outputs.push_back({1000 + i, pay_script(i % addresses)});
+    return tx;
+}
+
+static double run(libwallet::tx_db& db,
+    const std::vector<bc::hash_digest>& hashes, size_t readers, bool writer)
+{
+    std::atomic<bool> done(false);
+    std::atomic<size_t> queries(0);
+
+    auto read = [&](size_t seed)
+    {
+        size_t count = 0;
+        for (size_t i = seed; !done; ++i)
+        {
+            db.get_tx_height(hashes[i % hashes.size()]);
+            db.get_utxos(libwallet::address_set{address(i % addresses)});
+            count += 2;
+        }
+        queries += count;
+    };
+
+    auto write = [&]()
+    {
+        for (uint32_t i = transactions; !done; ++i)
+            db.insert(make_tx(i), libwallet::tx_state::unconfirmed);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < readers; ++i)
+        threads.emplace_back(read, i * 7919);
+    if (writer)
+        threads.emplace_back(write);
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(run_seconds));
+    done = true;
+    for (auto& thread: threads)
+        thread.join();
+    return queries / seconds_since(start);
+}
+
+static void save(libwallet::tx_db& db, const std::string& mode)
+{
+    std::ostringstream out;
+    if (mode == "serialize")
+        db.serialize();
+    else if (mode == "stream")
+        db.serialize(out, libwallet::compress_rows);
+    else if (mode == "dump")
+        db.dump(out);
+    else if (mode == "export")
+        db.export_rows(out, libwallet::export_format::json_lines);
+    else if (mode == "compact")
+        db.compact("contention.db");
+    else if (mode == "stats")
+        db.stats();
+}
+
+static void run_saves(const std::string& mode)
+{
+    libwallet::tx_db db;
+    for (uint32_t i = 0; i < transactions; ++i)
+        db.insert(make_tx(i), libwallet::tx_state::confirmed);
+
+    std::atomic<bool> done(false);
+    std::thread writer([&]()
+    {
+        for (uint32_t i = transactions; !done; ++i)
+            db.insert(make_tx(i), libwallet::tx_state::unconfirmed);
+    });
+
+    size_t saves = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (seconds_since(start) < run_seconds)
+    {
+        save(db, mode);
+        ++saves;
+    }
+    done = true;
+    writer.join();
+
+    std::cout << mode << "\t" << saves << "\t" << db.stats().copies <<
+        std::endl;
+}
+
+int main()
+{
+    std::cout << "readers\twriter\tqueries_per_sec" << std::endl;
+    for (bool writer: {false, true})
+    {
+        for (size_t readers: {1, 2, 4, 8})
+        {
+            libwallet::tx_db db;
+            std::vector<bc::hash_digest> hashes;
+            for (uint32_t i = 0; i < transactions; ++i)
+            {
+                auto tx = make_tx(i);
+                db.insert(tx, libwallet::tx_state::confirmed);
+                hashes.push_back(bc::hash_transaction(tx));
+            }
+
+            std::cout << readers << "\t" << writer << "\t" <<
+                static_cast<size_t>(run(db, hashes, readers, writer)) <<
+                std::endl;
+        }
+    }
+
+    std::cout << "save\tsaves\tcopies" << std::endl;
+    for (auto mode: {"serialize", "stream", "dump", "export", "compact",
+        "stats"})
+        run_saves(mode);
+    remove("contention.db");
+    return 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * Compares inserting transactions one call at a time, as the updater
+ * does, against handing the same transactions to insert_many. Each way
+ * runs in a process of its own, so that its peak RSS is its own.
+ */
+#include <chrono>
+#include <iostream>
+#include "measure.hpp"
+#include "wallet.hpp"
+
+static std::vector<libwallet::tx_insert> make_txs(size_t count)
+{
+    wallet_spec spec;
+    spec.txs = count;
+    std::vector<libwallet::tx_insert> out;
+    for (auto& row: generate_wallet(spec))
+        out.push_back({std::move(row.tx), row.state});
+    return out;
+}
+
+static measurement insert(size_t count, bool batch)
+{
+    auto txs = make_txs(count);
+    libwallet::tx_db db;
+    size_t added = 0;
+    auto start = std::chrono::steady_clock::now();
+    if (batch)
+        added = db.insert_many(txs).size();
+    else
+        for (const auto& tx: txs)
+            added += db.insert(tx.first, tx.second);
+    return {added == count, seconds_since(start), 0, 0};
+}
+
+int main()
+{
+    std::cout << "txs\tmode\tseconds\tpeak_rss_kb\tspeedup" << std::endl;
+    for (size_t count: {1000, 10000, 100000})
+    {
+        double baseline = 0;
+        for (bool batch: {false, true})
+        {
+            auto mode = batch ? "batch" : "single";
+            auto result = measure_apart([count, batch]()
+            {
+                return insert(count, batch);
+            });
+            if (!result.ok)
+            {
+                std::cerr << mode << " inserts went wrong" << std::endl;
+                continue;
+            }
+            if (!baseline)
+                baseline = result.seconds;
+            std::cout << count << "\t" << mode << "\t" << result.seconds <<
+                "\t" << result.peak_rss_kb << "\t" <<
+                baseline / result.seconds << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * Compares the ways of loading a saved database. The baseline, chunk,
+ * reads the file into memory and calls load(data_chunk), as the example
+ * used to. The rest call load_file, which parses straight out of a
+ * memory mapping: mmap as it is, lazy with lazy_txs, which also leaves
+ * the transactions in the mapping instead of keeping them decoded,
+ * parallel with parallel_parse, and verify with verify_txids.
+ *
+ * Each mode reports its time, its peak RSS, the heap allocations made
+ * while loading, and the heap bytes the loaded database still holds.
+ * Rows come from a few large arena blocks, so most of the allocations
+ * left are made inside libbitcoin's own transaction types. Every mode
+ * runs in a process of its own, so that its peak RSS is its own:
+ *
+ *   bench/load [txs] [compressed]
+ */
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include "alloc_count.hpp"
+#include "measure.hpp"
+#include "wallet.hpp"
+
+// Where the generated database goes while the modes load it:
+constexpr auto db_path = "load-bench.db";
+
+static void generate(const std::string& path, size_t count, unsigned flags)
+{
+    wallet_spec spec;
+    spec.txs = count;
+    libwallet::tx_db db;
+    for (const auto& row: generate_wallet(spec))
+        db.insert(row.tx, row.state);
+
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    db.serialize(file, flags);
+}
+
+/**
+ * What loading in one mode cost.
+ */
+struct load_result
+{
+    bool ok;
+    double seconds;
+    size_t allocations;
+    size_t heap_bytes;
+    long peak_rss_kb;
+};
+
+static load_result load(const std::string& mode)
+{
+    libwallet::tx_db db;
+    bool ok = false;
+    size_t before = 0, bytes = live_bytes;
+    auto start = std::chrono::steady_clock::now();
+    if (mode == "chunk")
+    {
+        std::ifstream file(db_path, std::ios::in | std::ios::binary);
+        bc::data_chunk data((std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+        before = allocations;
+        ok = db.load(data);
+    }
+    else
+    {
+        unsigned flags = 0;
+        if (mode == "lazy")
+            flags = libwallet::lazy_txs;
+        else if (mode == "parallel")
+            flags = libwallet::parallel_parse;
+        else if (mode == "verify")
+            flags = libwallet::verify_txids;
+        before = allocations;
+        ok = db.load_file(db_path, flags);
+    }
+    auto elapsed = seconds_since(start);
+    return {ok, elapsed, allocations - before, live_bytes - bytes, 0};
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 100000;
+    unsigned flags = 0;
+    if (argc > 2 && std::string(argv[2]) == "compressed")
+        flags = libwallet::compress_rows;
+
+    auto saved = measure_apart([count, flags]()
+    {
+        generate(db_path, count, flags);
+        return measurement{true, 0, 0, 0};
+    });
+    if (!saved.ok)
+    {
+        std::cerr << "failed to generate " << db_path << std::endl;
+        return 1;
+    }
+
+    std::cout << "mode\tseconds\tpeak_rss_kb\tallocations\theap_kb\t"
+        "speedup" << std::endl;
+    double baseline = 0;
+    for (auto mode: {"chunk", "mmap", "lazy", "parallel", "verify"})
+    {
+        auto result = measure_apart([mode]()
+        {
+            return load(mode);
+        });
+        if (!result.ok)
+        {
+            std::cerr << mode << " failed to load" << std::endl;
+            continue;
+        }
+        if (!baseline)
+            baseline = result.seconds;
+        std::cout << mode << "\t" << result.seconds << "\t" <<
+            result.peak_rss_kb << "\t" << result.allocations << "\t" <<
+            result.heap_bytes / 1024 << "\t" << baseline / result.seconds <<
+            std::endl;
+    }
+    remove(db_path);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * Compares the flat hash table behind tx_db against the standard
+ * unordered maps it replaced, at several sizes. The digest and point
+ * maps go from random keys to 64-bit values, like the utxo set, so the
+ * memory column shows the overhead of the container itself. The row
+ * maps hold the real, empty rows of tx_table, which the flat table
+ * keeps inline in every slot, used or not. Leaving out the allocator's
+ * own overhead per block flatters the node-based maps, which the peak
+ * RSS column does not. Each map runs in a process of its own, so that
+ * its peak RSS is its own.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include "../src/flat_map.hpp"
+#include "../src/tx_table.hpp"
+#include "alloc_count.hpp"
+#include "measure.hpp"
+#include "wallet.hpp"
+
+// The hasher the outpoint maps used before:
+struct old_point_hash
+{
+    size_t operator()(const bc::output_point& point) const
+    {
+        return std::hash<bc::hash_digest>()(point.hash) ^ point.index;
+    }
+};
+
+static bc::hash_digest random_digest(std::mt19937_64& random)
+{
+    bc::hash_digest out;
+    for (auto& byte: out)
+        byte = random();
+    return out;
+}
+
+/**
+ * The keys for a run of the given size, along with as many that are
+ * missing from it.
+ */
+struct key_set
+{
+    std::vector<bc::hash_digest> digests, missing_digests;
+    std::vector<bc::output_point> points, missing_points;
+};
+
+static key_set make_keys(size_t rows)
+{
+    key_set out;
+    std::mt19937_64 random(rows);
+    for (size_t i = 0; i < rows; ++i)
+    {
+        out.digests.push_back(random_digest(random));
+        out.missing_digests.push_back(random_digest(random));
+
+        // Transactions with a few outputs each:
+        auto& tx_hash = out.digests[i / 4 * 4];
+        out.points.push_back({tx_hash, uint32_t(i % 4)});
+        out.missing_points.push_back({tx_hash, uint32_t(i % 4 + 4)});
+    }
+    return out;
+}
+
+/**
+ * The cost of one map, per row.
+ */
+struct map_result
+{
+    bool ok;
+    double insert_ns;
+    double hit_ns;
+    double miss_ns;
+    double bytes;
+    long peak_rss_kb;
+};
+
+/**
+ * Fills a fresh map with `keys`, then looks up each key in a shuffled
+ * order, and as many keys that are missing.
+ */
+template <typename Map, typename Key>
+static map_result run(const std::vector<Key>& keys,
+    const std::vector<Key>& missing)
+{
+    size_t before = live_bytes;
+    Map map;
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& key: keys)
+        map[key];
+    auto insert = seconds_since(start);
+    auto bytes = live_bytes - before;
+
+    auto shuffled = keys;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(1));
+    size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto& key: shuffled)
+        found += map.find(key) != map.end();
+    auto hit = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (const auto& key: missing)
+        found += map.find(key) != map.end();
+    auto miss = seconds_since(start);
+
+    double count = keys.size();
+    return {found == keys.size(), 1e9 * insert / count, 1e9 * hit / count,
+        1e9 * miss / count, bytes / count, 0};
+}
+
+static void report(const std::string& name, size_t rows,
+    const map_result& result)
+{
+    if (!result.ok)
+    {
+        std::cerr << name << ": lookups went wrong" << std::endl;
+        return;
+    }
+    std::cout << name << "\t" << rows << "\t" << result.insert_ns << "\t" <<
+        result.hit_ns << "\t" << result.miss_ns << "\t" << result.bytes <<
+        "\t" << result.peak_rss_kb << std::endl;
+}
+
+int main()
+{
+    typedef std::unordered_map<bc::hash_digest, uint64_t> digest_map;
+    typedef libwallet::flat_map<bc::hash_digest, uint64_t,
+        libwallet::digest_hash> flat_digest_map;
+    typedef std::unordered_map<bc::output_point, uint64_t, old_point_hash>
+        point_map;
+    typedef libwallet::flat_map<bc::output_point, uint64_t,
+        libwallet::point_hash> flat_point_map;
+    typedef libwallet::tx_table::row_map flat_row_map;
+    typedef std::unordered_map<bc::hash_digest,
+        flat_row_map::value_type::second_type> row_map;
+
+    // Each child makes the same keys for itself, so that they count
+    // the same towards every map's peak RSS:
+    std::cout << "map\trows\tinsert_ns\thit_ns\tmiss_ns\tbytes_per_row\t"
+        "peak_rss_kb" << std::endl;
+    for (size_t rows: {10000, 100000, 1000000})
+    {
+        report("unordered_digest", rows, measure_apart([rows]()
+        {
+            auto keys = make_keys(rows);
+            return run<digest_map>(keys.digests, keys.missing_digests);
+        }));
+        report("flat_digest", rows, measure_apart([rows]()
+        {
+            auto keys = make_keys(rows);
+            return run<flat_digest_map>(keys.digests, keys.missing_digests);
+        }));
+        report("unordered_point", rows, measure_apart([rows]()
+        {
+            auto keys = make_keys(rows);
+            return run<point_map>(keys.points, keys.missing_points);
+        }));
+        report("flat_point", rows, measure_apart([rows]()
+        {
+            auto keys = make_keys(rows);
+            return run<flat_point_map>(keys.points, keys.missing_points);
+        }));
+        report("unordered_row", rows, measure_apart([rows]()
+        {
+            auto keys = make_keys(rows);
+            return run<row_map>(keys.digests, keys.missing_digests);
+        }));
+        report("flat_row", rows, measure_apart([rows]()
+        {
+            auto keys = make_keys(rows);
+            return run<flat_row_map>(keys.digests, keys.missing_digests);
+        }));
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef BENCH_MEASURE_HPP
+#define BENCH_MEASURE_HPP
+
+#include <cstddef>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * What one benchmark case cost. Cases can return a struct of their own
+ * instead, as long as it has the `ok` and `peak_rss_kb` fields and can
+ * be copied bytewise.
+ */
+struct measurement
+{
+    bool ok;
+    double seconds;
+    size_t allocations;
+    long peak_rss_kb;
+};
+
+/**
+ * Runs a case in a child process, and returns what it measured along
+ * with the child's peak RSS. Peak RSS is only kept per process, so
+ * this is what lets one run compare the cases against each other.
+ * The child starts out holding whatever this process already does, so
+ * cases should build their own inputs.
+ *
+ * The case fills in everything but the peak RSS. It must not write to
+ * stdout, since the child never flushes it.
+ */
+template <typename Case>
+auto measure_apart(Case run) -> decltype(run())
+{
+    typedef decltype(run()) result_type;
+    result_type out = result_type();
+    int pipes[2];
+    if (pipe(pipes) < 0)
+        return out;
+
+    auto pid = fork();
+    if (pid < 0)
+    {
+        close(pipes[0]);
+        close(pipes[1]);
+        return out;
+    }
+    if (0 == pid)
+    {
+        close(pipes[0]);
+        result_type result = run();
+        auto wrote = write(pipes[1], &result, sizeof(result));
+        _exit(static_cast<ssize_t>(sizeof(result)) == wrote ? 0 : 1);
+    }
+
+    close(pipes[1]);
+    result_type result;
+    auto got = read(pipes[0], &result, sizeof(result));
+    close(pipes[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 ||
+        static_cast<ssize_t>(sizeof(result)) != got)
+        return out;
+    result.peak_rss_kb = usage.ru_maxrss;
+    return result;
+}
+
+#endif
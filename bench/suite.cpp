@@ -0,0 +1,178 @@
+/**
+ * Times the main tx_table operations against synthetic wallets of
+ * increasing size, printing one tab-separated row per measurement so
+ * the results can be collected and compared across releases.
+ *
+ * This drives the table directly, without tx_db's locking, so it has
+ * to link against the library's internals. `make bench` at the top of
+ * the tree builds it that way and runs it. Settings go in BENCH_ARGS
+ * as name=value pairs:
+ *
+ *   make bench BENCH_ARGS="txs=1000,10000 addresses=500 fan_in=3"
+ *
+ * The settings are txs (a comma-separated list), addresses (0 for a
+ * tenth of txs), fan_in, fan_out, spend, confirmed, unconfirmed
+ * (all percentages) and seed.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "../src/tx_table.hpp"
+#include "wallet.hpp"
+
+// Query loops stop after this many calls:
+constexpr size_t max_queries = 10000;
+
+// Calls made to get_utxos, which visits every unspent output:
+constexpr size_t utxo_calls = 10;
+
+// Confirmed rows moved to another block for the check_fork timing:
+constexpr size_t max_forks = 1000;
+
+static void report(const std::string& name, const wallet_spec& spec,
+    size_t ops, double seconds)
+{
+    std::cout << name << "\t" << spec.txs << "\t" << spec.addresses <<
+        "\t" << spec.fan_in << "\t" << spec.fan_out << "\t" << spec.seed <<
+        "\t" << ops << "\t" << seconds << "\t" <<
+        (ops ? 1e9 * seconds / ops : 0) << "\n";
+}
+
+static void run(wallet_spec spec)
+{
+    auto txs = generate_wallet(spec);
+
+    // Hashing is part of what an insert costs, so it gets timed too:
+    libwallet::tx_table table;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& row: txs)
+        table.insert(row.tx, row.state);
+    report("insert", spec, txs.size(), seconds_since(start));
+
+    size_t confirmed = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto& row: txs)
+        if (libwallet::tx_state::confirmed == row.state)
+            confirmed += table.confirmed(row.hash, row.height);
+    report("confirmed", spec, confirmed, seconds_since(start));
+
+    size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < utxo_calls; ++i)
+        found += table.get_utxos().size();
+    report("get_utxos", spec, utxo_calls, seconds_since(start));
+
+    auto addresses = std::min(spec.addresses, max_queries);
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < addresses; ++i)
+        found += table.has_history(address(i));
+    report("has_history", spec, addresses, seconds_since(start));
+
+    // The wallet owns every address, so spends can come out true:
+    libwallet::address_set owned;
+    for (uint32_t i = 0; i < spec.addresses; ++i)
+        owned.insert(spend_address(i));
+    auto queries = std::min(txs.size(), max_queries);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < queries; ++i)
+        found += table.is_spend(txs[i].hash, owned);
+    report("is_spend", spec, queries, seconds_since(start));
+
+    // Moving a confirmed row to another block marks the block below
+    // its old one for checking:
+    {
+        libwallet::tx_table forked(table);
+        size_t forks = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < txs.size() && forks < max_forks; ++i)
+        {
+            if (libwallet::tx_state::confirmed != txs[i].state)
+                continue;
+            forked.confirmed(txs[i].hash, txs[i].height + 1);
+            ++forks;
+        }
+        report("check_fork", spec, forks, seconds_since(start));
+    }
+
+    start = std::chrono::steady_clock::now();
+    auto blob = table.serialize(0);
+    report("serialize", spec, 1, seconds_since(start));
+
+    start = std::chrono::steady_clock::now();
+    auto compressed = table.serialize(libwallet::compress_rows);
+    report("serialize_compressed", spec, 1, seconds_since(start));
+
+    for (unsigned flags: {0u, unsigned(libwallet::parallel_parse)})
+    {
+        libwallet::tx_table loaded;
+        start = std::chrono::steady_clock::now();
+        bool ok = loaded.load(blob.data(), blob.size(), nullptr, flags);
+        auto name = flags ? "load_parallel" : "load";
+        report(name, spec, 1, seconds_since(start));
+        if (!ok)
+            std::cerr << name << " failed" << std::endl;
+    }
+
+    // Keep the queries from being optimized away:
+    if (!found)
+        std::cerr << "queries found nothing" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    wallet_spec spec;
+    spec.addresses = 0;
+    std::vector<size_t> sizes = {1000, 10000, 100000};
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto equals = arg.find('=');
+        if (equals == std::string::npos)
+        {
+            std::cerr << "usage: suite [name=value]..." << std::endl;
+            return 1;
+        }
+        auto name = arg.substr(0, equals);
+        std::istringstream value(arg.substr(equals + 1));
+        if (name == "txs")
+        {
+            sizes.clear();
+            std::string size;
+            while (std::getline(value, size, ','))
+                sizes.push_back(std::stoul(size));
+        }
+        else if (name == "addresses")
+            value >> spec.addresses;
+        else if (name == "fan_in")
+            value >> spec.fan_in;
+        else if (name == "fan_out")
+            value >> spec.fan_out;
+        else if (name == "spend")
+            value >> spec.spend_percent;
+        else if (name == "confirmed")
+            value >> spec.confirmed_percent;
+        else if (name == "unconfirmed")
+            value >> spec.unconfirmed_percent;
+        else if (name == "seed")
+            value >> spec.seed;
+        else
+        {
+            std::cerr << "unknown setting " << name << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "benchmark\ttxs\taddresses\tfan_in\tfan_out\tseed\tops\t"
+        "seconds\tns_per_op\n";
+    bool default_addresses = !spec.addresses;
+    for (auto size: sizes)
+    {
+        spec.txs = size;
+        if (default_addresses)
+            spec.addresses = std::max<size_t>(size / 10, 1);
+        run(spec);
+    }
+    return 0;
+}
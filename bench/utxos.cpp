@@ -0,0 +1,57 @@
+/**
+ * Measures tx_db::get_utxos against databases with the same number of
+ * unspent outputs, but increasingly long spent histories. The time per
+ * call should stay flat as the history grows.
+ */
+#include <chrono>
+#include <iostream>
+#include "wallet.hpp"
+
+constexpr size_t wallet_utxos = 1000;
+constexpr size_t calls = 1000;
+
+/**
+ * Builds a database holding `wallet_utxos` unspent outputs plus a chain
+ * of `history` transactions, each spending the one before it.
+ */
+static void fill(libwallet::tx_db& db, size_t history)
+{
+    bc::transaction_type funding;
+    funding.version = 1;
+    funding.locktime = 0;
+    for (uint32_t i = 0; i < wallet_utxos; ++i)
+        funding.outputs.push_back({1000 + i, pay_script(i)});
+    db.insert(funding, libwallet::tx_state::confirmed);
+
+    bc::output_point previous = {bc::hash_transaction(funding), 0};
+    for (uint32_t i = 0; i < history; ++i)
+    {
+        bc::transaction_type tx;
+        tx.version = 1;
+        tx.locktime = i;
+        tx.inputs.push_back({previous, bc::script_type(), 0xffffffff});
+        tx.outputs.push_back({1000, pay_script(0)});
+        db.insert(tx, libwallet::tx_state::confirmed);
+        previous = {bc::hash_transaction(tx), 0};
+    }
+}
+
+int main()
+{
+    std::cout << "history\tutxos\tus_per_call" << std::endl;
+    for (size_t history: {0, 1000, 10000, 100000})
+    {
+        libwallet::tx_db db;
+        fill(db, history);
+
+        size_t count = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i)
+            count += db.get_utxos().size();
+        auto elapsed = seconds_since(start);
+
+        std::cout << history << "\t" << count / calls << "\t" <<
+            1e6 * elapsed / calls << std::endl;
+    }
+    return 0;
+}
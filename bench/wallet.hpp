@@ -0,0 +1,209 @@
+#ifndef BENCH_WALLET_HPP
+#define BENCH_WALLET_HPP
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <bitcoin/watcher.hpp>
+
+/**
+ * Helpers for building synthetic transactions and wallets in the
+ * benchmarks. generate_wallet gives the same transactions for the same
+ * settings, so timings from different builds can be compared directly.
+ */
+
+/**
+ * Returns the address that `pay_script(seed)` pays to.
+ */
+inline bc::short_hash address_hash(uint32_t seed)
+{
+    bc::short_hash hash;
+    for (size_t i = 0; i < hash.size(); ++i)
+        hash[i] = static_cast<uint8_t>(seed >> (8 * (i % 4)));
+    return hash;
+}
+
+inline bc::payment_address address(uint32_t seed)
+{
+    return bc::payment_address(0, address_hash(seed));
+}
+
+/**
+ * Builds a pay-to-pubkey-hash output script.
+ */
+inline bc::script_type pay_script(uint32_t seed)
+{
+    auto hash = address_hash(seed);
+
+    bc::script_type script;
+    script.push_operation({bc::opcode::dup, bc::data_chunk()});
+    script.push_operation({bc::opcode::hash160, bc::data_chunk()});
+    script.push_operation({bc::opcode::special,
+        bc::data_chunk(hash.begin(), hash.end())});
+    script.push_operation({bc::opcode::equalverify, bc::data_chunk()});
+    script.push_operation({bc::opcode::checksig, bc::data_chunk()});
+    return script;
+}
+
+/**
+ * Seconds elapsed since `start`, as a double.
+ */
+inline double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::duration<double>>(
+        elapsed).count();
+}
+
+/**
+ * Settings for generate_wallet.
+ */
+struct wallet_spec
+{
+    // The number of distinct addresses that outputs pay to:
+    size_t addresses = 1000;
+
+    // The number of transactions, with this many inputs and outputs:
+    size_t txs = 10000;
+    size_t fan_in = 2;
+    size_t fan_out = 2;
+
+    // The chance, in percent, that an input spends an earlier output of
+    // the wallet rather than coming from outside:
+    unsigned spend_percent = 50;
+
+    // The share of transactions in each state, in percent. Whatever is
+    // left over is unsent:
+    unsigned confirmed_percent = 80;
+    unsigned unconfirmed_percent = 15;
+
+    // Confirmed transactions fill blocks this size, in order:
+    size_t txs_per_block = 10;
+
+    uint64_t seed = 1;
+};
+
+/**
+ * A transaction from generate_wallet, with what the database should
+ * say about it.
+ */
+struct generated_tx
+{
+    bc::transaction_type tx;
+    bc::hash_digest hash;
+    libwallet::tx_state state;
+    size_t height;
+};
+
+/**
+ * The public key whose signature spends outputs paying to `seed`.
+ * Input scripts carry it, so spends have an address to extract.
+ */
+inline bc::data_chunk spend_pubkey(uint32_t seed)
+{
+    bc::data_chunk pubkey(33, static_cast<uint8_t>(seed));
+    pubkey[0] = 0x02;
+    for (size_t i = 0; i < 4; ++i)
+        pubkey[1 + i] = static_cast<uint8_t>(seed >> (8 * i));
+    return pubkey;
+}
+
+/**
+ * The address that the inputs spending outputs to `seed` come from.
+ */
+inline bc::payment_address spend_address(uint32_t seed)
+{
+    return bc::payment_address(0, bc::bitcoin_short_hash(spend_pubkey(seed)));
+}
+
+/**
+ * Builds a signature-and-pubkey input script.
+ */
+inline bc::script_type spend_script(uint32_t seed)
+{
+    bc::script_type script;
+    script.push_operation({bc::opcode::special, bc::data_chunk(72, 0x30)});
+    script.push_operation({bc::opcode::special, spend_pubkey(seed)});
+    return script;
+}
+
+/**
+ * Builds a wallet's transactions, in an order they can be inserted.
+ */
+inline std::vector<generated_tx> generate_wallet(const wallet_spec& spec)
+{
+    // The generator's own output is specified by the standard, unlike
+    // the distributions, so only that gets used:
+    std::mt19937_64 random(spec.seed);
+
+    // Outputs still unspent, with the address seed each one pays:
+    struct coin
+    {
+        bc::output_point point;
+        uint32_t seed;
+    };
+    std::vector<coin> unspent;
+
+    bc::hash_digest outside;
+    outside.fill(0xee);
+
+    std::vector<generated_tx> out;
+    out.reserve(spec.txs);
+    size_t height = 1, in_block = 0;
+    for (size_t i = 0; i < spec.txs; ++i)
+    {
+        bc::transaction_type tx;
+        tx.version = 1;
+        tx.locktime = static_cast<uint32_t>(i);
+        for (size_t j = 0; j < spec.fan_in; ++j)
+        {
+            if (!unspent.empty() && random() % 100 < spec.spend_percent)
+            {
+                auto k = random() % unspent.size();
+                auto spent = unspent[k];
+                unspent[k] = unspent.back();
+                unspent.pop_back();
+                tx.inputs.push_back({spent.point, spend_script(spent.seed),
+                    0xffffffff});
+                continue;
+            }
+            bc::output_point point =
+                {outside, static_cast<uint32_t>(i * spec.fan_in + j)};
+            tx.inputs.push_back({point, bc::script_type(), 0xffffffff});
+        }
+        std::vector<uint32_t> seeds;
+        for (size_t j = 0; j < spec.fan_out; ++j)
+        {
+            auto seed = static_cast<uint32_t>(random() % spec.addresses);
+            seeds.push_back(seed);
+            tx.outputs.push_back({1000 + random() % 100000, pay_script(seed)});
+        }
+
+        generated_tx row;
+        row.hash = bc::hash_transaction(tx);
+        for (uint32_t j = 0; j < spec.fan_out; ++j)
+            unspent.push_back({{row.hash, j}, seeds[j]});
+
+        auto roll = random() % 100;
+        row.height = 0;
+        if (roll < spec.confirmed_percent)
+        {
+            row.state = libwallet::tx_state::confirmed;
+            row.height = height;
+            if (spec.txs_per_block <= ++in_block)
+            {
+                ++height;
+                in_block = 0;
+            }
+        }
+        else if (roll < spec.confirmed_percent + spec.unconfirmed_percent)
+            row.state = libwallet::tx_state::unconfirmed;
+        else
+            row.state = libwallet::tx_state::unsent;
+        row.tx = std::move(tx);
+        out.push_back(std::move(row));
+    }
+    return out;
+}
+
+#endif
@@ -53,9 +53,13 @@ private:
     void cmd_tx_dump(std::stringstream& args);
     void cmd_tx_send(std::stringstream& args);
     void cmd_utxos(std::stringstream& args);
+    void cmd_balance(std::stringstream& args);
+    void cmd_history(std::stringstream& args);
     void cmd_save(std::stringstream& args);
     void cmd_load(std::stringstream& args);
     void cmd_dump(std::stringstream& args);
+    void cmd_export(std::stringstream& args);
+    void cmd_stats(std::stringstream& args);
 
     // tx_callbacks interface:
     virtual void on_add(const bc::transaction_type& tx) override;
@@ -146,9 +150,13 @@ void cli::command()
     else if (command == "txdump")       cmd_tx_dump(reader);
     else if (command == "txsend")       cmd_tx_send(reader);
     else if (command == "utxos")        cmd_utxos(reader);
+    else if (command == "balance")      cmd_balance(reader);
+    else if (command == "history")      cmd_history(reader);
     else if (command == "save")         cmd_save(reader);
     else if (command == "load")         cmd_load(reader);
     else if (command == "dump")         cmd_dump(reader);
+    else if (command == "export")       cmd_export(reader);
+    else if (command == "stats")        cmd_stats(reader);
     else
         std::cout << "unknown command " << command << std::endl;
 
@@ -175,9 +183,13 @@ void cli::cmd_help()
     std::cout << "  txdump <hash>     - show the contents of a transaction" << std::endl;
     std::cout << "  txsend <hash>     - push a transaction to the server" << std::endl;
     std::cout << "  utxos [address]   - get utxos for an address" << std::endl;
+    std::cout << "  balance [address] - get the balance of an address" << std::endl;
+    std::cout << "  history <address> [height] - list an address's transactions" << std::endl;
     std::cout << "  save <filename>   - dump the database to disk" << std::endl;
     std::cout << "  load <filename>   - load the database from disk" << std::endl;
     std::cout << "  dump [filename]   - display the database contents" << std::endl;
+    std::cout << "  export <filename> [binary] - write the rows as JSON lines" << std::endl;
+    std::cout << "  stats [on|off]    - show database sizes and timings" << std::endl;
 }
 
 void cli::cmd_connect(std::stringstream& args)
@@ -237,6 +249,10 @@ void cli::cmd_tx_dump(std::stringstream& args)
     serial.set_iterator(satoshi_save(tx, serial.iterator()));
     auto str = stream.str();
     std::cout << bc::encode_hex(str) << std::endl;
+
+    for (auto& conflict: db_.get_conflicts(txid))
+        std::cout << "conflicts with: " << bc::encode_hex(conflict) <<
+            std::endl;
 }
 
 void cli::cmd_tx_send(std::stringstream& args)
@@ -280,11 +296,14 @@ void cli::cmd_watch(std::stringstream& args)
 
 void cli::cmd_utxos(std::stringstream& args)
 {
+    // Read everything from one consistent view of the database:
+    auto snapshot = db_.snapshot();
+
     bc::output_info_list utxos;
     if (connection_)
-        utxos = db_.get_utxos(connection_->updater_.watching());
+        utxos = snapshot.get_utxos(connection_->updater_.watching());
     else
-        utxos = db_.get_utxos();
+        utxos = snapshot.get_utxos();
 
     // Display the output:
     size_t total = 0;
@@ -292,8 +311,9 @@ void cli::cmd_utxos(std::stringstream& args)
     {
         std::cout << bc::encode_hex(utxo.point.hash) << ":" <<
             utxo.point.index << std::endl;
-        auto tx = db_.get_tx(utxo.point.hash);
-        auto& output = tx.outputs[utxo.point.index];
+        bc::transaction_output_type output;
+        if (!snapshot.get_output(utxo.point, output))
+            continue;
         bc::payment_address to_address;
         if (bc::extract(to_address, output.script))
             std::cout << "address: " << to_address.encoded() << " ";
@@ -303,22 +323,85 @@ void cli::cmd_utxos(std::stringstream& args)
     std::cout << "total: " << total << std::endl;
 }
 
+void cli::cmd_balance(std::stringstream& args)
+{
+    // Use the given address, or else every watched one:
+    libwallet::address_set addresses;
+    std::string encoded;
+    args >> encoded;
+    if (encoded.size())
+    {
+        bc::payment_address address;
+        if (!address.set_encoded(encoded))
+        {
+            std::cout << "error: invalid address " << encoded << std::endl;
+            return;
+        }
+        addresses.insert(address);
+    }
+    else if (connection_)
+        addresses = connection_->updater_.watching();
+
+    auto balance = db_.get_balance(addresses);
+    std::cout << "confirmed: " << balance.confirmed << std::endl;
+    std::cout << "unconfirmed: " << balance.unconfirmed << std::endl;
+}
+
+void cli::cmd_history(std::stringstream& args)
+{
+    bc::payment_address address;
+    if (!read_address(args, address))
+        return;
+    size_t height = 0;
+    args >> height;
+
+    // Fetch the history a page at a time, as a server would:
+    const size_t page_size = 100;
+    auto snapshot = db_.snapshot();
+    auto page = snapshot.get_history(address, height, page_size);
+    while (page.size())
+    {
+        for (auto& row: page)
+        {
+            std::cout << bc::encode_hex(row.tx_hash);
+            switch (row.state)
+            {
+            case libwallet::tx_state::unsent:
+                std::cout << " unsent" << std::endl;
+                break;
+            case libwallet::tx_state::unconfirmed:
+                std::cout << " unconfirmed" << std::endl;
+                break;
+            case libwallet::tx_state::confirmed:
+                std::cout << " height: " << row.block_height << std::endl;
+                break;
+            }
+        }
+        if (page.size() < page_size)
+            break;
+        auto& last = page.back();
+        page = snapshot.get_history(address, last.block_height, page_size,
+            last.tx_hash);
+    }
+}
+
 void cli::cmd_save(std::stringstream& args)
 {
     std::string filename;
     if (!read_string(args, filename, "no filename given"))
         return;
 
-    std::ofstream file(filename);
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
     if (!file.is_open())
     {
         std::cerr << "cannot open " << filename << std::endl;
         return;
     }
 
-    auto db = db_.serialize();
-    file.write(reinterpret_cast<const char*>(db.data()), db.size());
+    db_.serialize(file);
     file.close();
+    if (!file)
+        std::cerr << "error while saving data" << std::endl;
 }
 
 void cli::cmd_load(std::stringstream& args)
@@ -327,21 +410,8 @@ void cli::cmd_load(std::stringstream& args)
     if (!read_string(args, filename, "no filename given"))
         return;
 
-    std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
-    if (!file.is_open())
-    {
-        std::cerr << "cannot open " << filename << std::endl;
-        return;
-    }
-
-    std::streampos size = file.tellg();
-    uint8_t *data = new uint8_t[size];
-    file.seekg(0, std::ios::beg);
-    file.read(reinterpret_cast<char*>(data), size);
-    file.close();
-
-    if (!db_.load(bc::data_chunk(data, data + size)))
-        std::cerr << "error while loading data" << std::endl;
+    if (!db_.load_file(filename))
+        std::cerr << "error while loading " << filename << std::endl;
 }
 
 void cli::cmd_dump(std::stringstream& args)
@@ -362,6 +432,63 @@ void cli::cmd_dump(std::stringstream& args)
         db_.dump(std::cout);
 }
 
+void cli::cmd_export(std::stringstream& args)
+{
+    std::string filename;
+    if (!read_string(args, filename, "no filename given"))
+        return;
+    std::string format;
+    args >> format;
+
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "cannot open " << filename << std::endl;
+        return;
+    }
+    if (format == "binary")
+        db_.export_rows(file, libwallet::export_format::binary);
+    else
+        db_.export_rows(file, libwallet::export_format::json_lines);
+    if (!file)
+        std::cerr << "error while writing " << filename << std::endl;
+}
+
+void cli::cmd_stats(std::stringstream& args)
+{
+    std::string arg;
+    args >> arg;
+    if (arg == "on" || arg == "off")
+    {
+        db_.enable_stats(arg == "on");
+        return;
+    }
+
+    auto stats = db_.stats();
+    std::cout << "rows: " << stats.rows << " unsent: " << stats.unsent <<
+        " unconfirmed: " << stats.unconfirmed << " confirmed: " <<
+        stats.confirmed << " forked: " << stats.forked << " utxos: " <<
+        stats.utxos << std::endl;
+    if (!stats.enabled)
+        std::cout << "timings are off; use \"stats on\"" << std::endl;
+
+    auto show = [](const std::string& name,
+        const libwallet::latency_histogram& histogram)
+    {
+        if (!histogram.count)
+            return;
+        std::cout << name << ": calls: " << histogram.count <<
+            " mean us: " << histogram.total_us / histogram.count <<
+            " max us: " << histogram.max_us << std::endl;
+    };
+    show("shared wait", stats.shared_wait);
+    show("shared hold", stats.shared_hold);
+    show("unique wait", stats.unique_wait);
+    show("unique hold", stats.unique_hold);
+    for (auto& call: stats.calls)
+        show(call.first, call.second);
+}
+
 void cli::on_add(const libbitcoin::transaction_type& tx)
 {
     auto txid = libbitcoin::encode_hex(libbitcoin::hash_transaction(tx));
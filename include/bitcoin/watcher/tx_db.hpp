@@ -20,10 +20,17 @@
 #define LIBBITCOIN_WATCHER_TX_DB_HPP
 
 #include <bitcoin/bitcoin.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <ostream>
-#include <unordered_map>
+#include <string>
 #include <unordered_set>
+#include <vector>
 #include <time.h>
 
 namespace libwallet {
@@ -40,6 +47,271 @@ enum class tx_state
 
 typedef std::unordered_set<bc::payment_address> address_set;
 
+/**
+ * The total value of the unspent outputs paying to some addresses,
+ * split by whether the transactions creating them are confirmed.
+ */
+struct address_balance
+{
+    uint64_t confirmed;
+    uint64_t unconfirmed;
+};
+
+/**
+ * A transaction in an address's history. Transactions that are not
+ * in a block have a height of 0.
+ */
+struct history_row
+{
+    bc::hash_digest tx_hash;
+    tx_state state;
+    size_t block_height;
+};
+typedef std::vector<history_row> history_list;
+
+/**
+ * Options for tx_db::load_file.
+ */
+enum load_flags
+{
+    /// Leave the transactions in the memory-mapped file, and decode them
+    /// only when a query needs them. This saves startup time and memory
+    /// for large wallets. The file must not be changed in place while the
+    /// database is using it, though replacing it by renaming is fine.
+    lazy_txs = 1 << 0,
+
+    /// Decode and hash the transactions on all cores. Files in the
+    /// original format must still be stepped through on one thread to
+    /// find where each row starts, though that is cheaper than
+    /// decoding them.
+    parallel_parse = 1 << 1,
+
+    /// Check the hash stored with each transaction in the original
+    /// format, failing the load on a mismatch. The compact format does
+    /// not store hashes, so its transactions are always hashed afresh.
+    verify_txids = 1 << 2
+};
+
+/**
+ * Options for tx_db::serialize and tx_db::compact.
+ */
+enum save_flags
+{
+    /// Run the rows through zlib. This shrinks the output, but costs
+    /// time on both save and load, and loading a compressed file with
+    /// lazy_txs keeps the inflated rows in memory rather than in the
+    /// mapped file.
+    compress_rows = 1 << 0
+};
+
+/**
+ * Formats for tx_db::export_rows.
+ */
+enum class export_format
+{
+    /// Each row as its hash, followed by the row as serialize stores it
+    /// without compression.
+    binary,
+    /// Each row as a JSON object on a line of its own.
+    json_lines
+};
+
+/**
+ * Picks the rows that tx_db::export_rows writes.
+ * A default-constructed filter picks every row.
+ */
+struct export_filter
+{
+    export_filter()
+      : unsent(true), unconfirmed(true), confirmed(true),
+        min_height(0), max_height(std::numeric_limits<size_t>::max())
+    {
+    }
+
+    // The states to include:
+    bool unsent;
+    bool unconfirmed;
+    bool confirmed;
+
+    // The block heights to include, inclusive. Transactions that are
+    // not in a block count as height 0:
+    size_t min_height;
+    size_t max_height;
+};
+
+/**
+ * A distribution of durations, in microseconds. The first bucket
+ * counts durations under 1us, and each bucket after that counts those
+ * under twice the limit of the one before. The last bucket also takes
+ * everything longer.
+ */
+struct latency_histogram
+{
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    std::vector<uint64_t> buckets;
+};
+
+/**
+ * What tx_db::stats reports.
+ */
+struct tx_db_stats
+{
+    // The sizes of the database, which are always available:
+    size_t rows;
+    size_t unsent;
+    size_t unconfirmed;
+    size_t confirmed;
+    size_t forked;
+    size_t utxos;
+
+    // The number of times a change had to copy the whole table because
+    // a snapshot was still looking at it:
+    size_t copies;
+
+    // The rest stays empty unless metrics are on:
+    bool enabled;
+
+    // Time spent waiting for the database lock, and holding it:
+    latency_histogram shared_wait;
+    latency_histogram shared_hold;
+    latency_histogram unique_wait;
+    latency_histogram unique_hold;
+
+    // The latency of each method, by name:
+    std::map<std::string, latency_histogram> calls;
+};
+
+/**
+ * A transaction to insert, along with the state it starts out in.
+ */
+typedef std::pair<bc::transaction_type, tx_state> tx_insert;
+
+class tx_journal;
+class tx_metrics;
+class tx_table;
+
+/**
+ * A read-only view of a tx_db, frozen at the moment it was taken.
+ *
+ * Snapshots are cheap to take and to copy. Their queries need no locking,
+ * so a caller can run a whole series of them against one consistent state
+ * while the updater keeps changing the database. Holding a snapshot does
+ * make the next change to the database copy its contents, though, so
+ * don't keep them around longer than needed.
+ */
+class BC_API tx_snapshot
+{
+public:
+    BC_API ~tx_snapshot();
+
+    /**
+     * Returns the highest block that the database had seen.
+     */
+    BC_API size_t last_height() const;
+
+    /**
+     * Returns true if the database contains a transaction.
+     */
+    BC_API bool has_tx(bc::hash_digest tx_hash) const;
+
+    /**
+     * Obtains a transaction from the database.
+     */
+    BC_API bc::transaction_type get_tx(bc::hash_digest tx_hash) const;
+
+    /**
+     * Calls `f` with the stored transaction, without copying it.
+     * The reference is only good until `f` returns.
+     * @return false if the transaction is not in the database.
+     */
+    typedef std::function<void (const bc::transaction_type& tx)> tx_fn;
+    BC_API bool with_tx(bc::hash_digest tx_hash, const tx_fn& f) const;
+
+    /**
+     * Obtains a single output, without copying the rest of the
+     * transaction it belongs to.
+     * @return false if the database does not have the output.
+     */
+    BC_API bool get_output(const bc::output_point& point,
+        bc::transaction_output_type& out) const;
+
+    /**
+     * Finds a transaction's height, or 0 if it isn't in a block.
+     */
+    BC_API size_t get_tx_height(bc::hash_digest tx_hash) const;
+
+    /**
+     * Returns true if all inputs are addresses in the list control.
+     */
+    BC_API bool is_spend(bc::hash_digest tx_hash,
+        const address_set& addresses) const;
+
+    /**
+     * Returns true if this address has received any funds.
+     */
+    BC_API bool has_history(const bc::payment_address& address) const;
+
+    /**
+     * Returns the hashes of all transactions that pay to or spend from
+     * an address, in no particular order.
+     */
+    BC_API std::vector<bc::hash_digest> get_address_txs(
+        const bc::payment_address& address) const;
+
+    /**
+     * Returns a page of an address's history. See tx_db::get_history.
+     */
+    BC_API history_list get_history(const bc::payment_address& address,
+        size_t from_height, size_t limit,
+        bc::hash_digest cursor=bc::null_hash) const;
+
+    /**
+     * Finds the transaction spending an output. See tx_db::get_spender.
+     */
+    BC_API bc::hash_digest get_spender(const bc::output_point& point) const;
+
+    /**
+     * Finds the transactions that double spend with one.
+     * See tx_db::get_conflicts.
+     */
+    BC_API std::vector<bc::hash_digest> get_conflicts(
+        bc::hash_digest tx_hash) const;
+
+    /**
+     * Get all unspent outputs in the database.
+     */
+    BC_API bc::output_info_list get_utxos() const;
+
+    /**
+     * Get just the utxos corresponding to a set of addresses.
+     */
+    BC_API bc::output_info_list get_utxos(const address_set& addresses) const;
+
+    /**
+     * Get the balance of a set of addresses.
+     */
+    BC_API address_balance get_balance(const address_set& addresses) const;
+
+    /**
+     * Debug dump to show db contents.
+     */
+    BC_API void dump(std::ostream& out) const;
+
+    /**
+     * Writes the rows for analysis. See tx_db::export_rows.
+     */
+    BC_API void export_rows(std::ostream& out, export_format format,
+        const export_filter& filter=export_filter()) const;
+
+private:
+    friend class tx_db;
+    tx_snapshot(std::shared_ptr<const tx_table> table);
+
+    std::shared_ptr<const tx_table> table_;
+};
+
 /**
  * A list of transactions.
  *
@@ -56,6 +328,11 @@ public:
     BC_API ~tx_db();
     BC_API tx_db(unsigned unconfirmed_timeout=24*60*60);
 
+    /**
+     * Captures the current contents of the database for lock-free reading.
+     */
+    BC_API tx_snapshot snapshot();
+
     /**
      * Returns the highest block that this database has seen.
      */
@@ -71,6 +348,23 @@ public:
      */
     BC_API bc::transaction_type get_tx(bc::hash_digest tx_hash);
 
+    /**
+     * Calls `f` with the stored transaction, without copying it.
+     * The database is not locked while `f` runs, so `f` may call back
+     * into it. The reference is only good until `f` returns.
+     * @return false if the transaction is not in the database.
+     */
+    typedef std::function<void (const bc::transaction_type& tx)> tx_fn;
+    BC_API bool with_tx(bc::hash_digest tx_hash, const tx_fn& f);
+
+    /**
+     * Obtains a single output, without copying the rest of the
+     * transaction it belongs to.
+     * @return false if the database does not have the output.
+     */
+    BC_API bool get_output(const bc::output_point& point,
+        bc::transaction_output_type& out);
+
     /**
      * Finds a transaction's height, or 0 if it isn't in a block.
      */
@@ -87,6 +381,41 @@ public:
      */
     BC_API bool has_history(const bc::payment_address& address);
 
+    /**
+     * Returns the hashes of all transactions that pay to or spend from
+     * an address, in no particular order.
+     */
+    BC_API std::vector<bc::hash_digest> get_address_txs(
+        const bc::payment_address& address);
+
+    /**
+     * Returns up to `limit` of the transactions that pay to or spend
+     * from an address, ordered by height and then by hash, starting at
+     * `from_height`. Transactions not yet in a block come first, at
+     * height 0. To get the next page, pass the height and hash of the
+     * last row as `from_height` and `cursor`. The cost is in proportion
+     * to the size of the page, not of the whole history.
+     */
+    BC_API history_list get_history(const bc::payment_address& address,
+        size_t from_height, size_t limit,
+        bc::hash_digest cursor=bc::null_hash);
+
+    /**
+     * Finds the transaction in the database that spends an output, or
+     * returns the null hash if none does. If several do, this returns
+     * the first one seen, and get_conflicts finds the others.
+     */
+    BC_API bc::hash_digest get_spender(const bc::output_point& point);
+
+    /**
+     * Finds the other transactions in the database that spend any of
+     * the same outputs as a transaction. At most one of them can ever
+     * confirm, so an unconfirmed transaction with conflicts may be a
+     * double spend. The cost is in proportion to the number of inputs.
+     */
+    BC_API std::vector<bc::hash_digest> get_conflicts(
+        bc::hash_digest tx_hash);
+
     /**
      * Get all unspent outputs in the database.
      */
@@ -98,43 +427,161 @@ public:
     BC_API bc::output_info_list get_utxos(const address_set& addresses);
 
     /**
-     * Write the database to an in-memory blob.
+     * Get the balance of a set of addresses. This adds up running
+     * totals kept for each address, so it costs the same however much
+     * history the addresses have.
      */
-    BC_API bc::data_chunk serialize();
+    BC_API address_balance get_balance(const address_set& addresses);
+
+    /**
+     * Write the database to an in-memory blob. The rows are copied out
+     * under a shared lock, and only compressed once it is let go.
+     * @param flags a combination of save_flags values.
+     */
+    BC_API bc::data_chunk serialize(unsigned flags=0);
+
+    /**
+     * Write the database to a stream, a chunk of rows at a time,
+     * without building the whole blob in memory first. This works from
+     * a snapshot, so changes can continue meanwhile, but the first one
+     * made before it finishes copies the table. Check the stream for
+     * errors after.
+     * @param flags a combination of save_flags values.
+     */
+    BC_API void serialize(std::ostream& out, unsigned flags=0);
 
     /**
      * Reconstitute the database from an in-memory blob.
+     * @param flags a combination of load_flags values. The blob need
+     * not outlive the database, so lazy_txs has no effect here.
      */
-    BC_API bool load(const bc::data_chunk& data);
+    BC_API bool load(const bc::data_chunk& data, unsigned flags=0);
+    BC_API bool load(const uint8_t* data, size_t size, unsigned flags=0);
 
     /**
-     * Debug dump to show db contents.
+     * Reconstitute the database from a file on disk.
+     * The file is memory-mapped and parsed in place, without being
+     * read into an intermediate buffer.
+     * @param flags a combination of load_flags values.
+     */
+    BC_API bool load_file(const std::string& path, unsigned flags=0);
+
+    /**
+     * Start logging every change to an append-only journal file, so
+     * keeping the database on disk costs in proportion to the changes
+     * rather than to the size of the wallet.
+     *
+     * Any records already in the journal are replayed on top of the
+     * current contents first, so the usual startup sequence is to
+     * `load_file` the last base snapshot, then open the journal.
+     * Inserts, confirmations, forgets and height changes are logged.
+     * Timestamps are not, so replayed rows count as freshly seen.
+     */
+    BC_API bool open_journal(const std::string& path);
+
+    /**
+     * Write the current contents to `path` as a new base snapshot, then
+     * drop the journal records that it covers. Changes can continue
+     * while the snapshot is written. This also recovers from a failed
+     * journal write, unless changes were made while it ran, since
+     * those never reached the journal.
+     * @param flags a combination of save_flags values.
+     */
+    BC_API bool compact(const std::string& path, unsigned flags=0);
+
+    /**
+     * True if writing to the journal has failed, so the latest changes
+     * would not survive a restart. Nothing more is logged from then on,
+     * until `compact` writes out a fresh base snapshot with no changes
+     * made in the meantime.
+     */
+    BC_API bool journal_failed();
+
+    /**
+     * Forget the unsent and unconfirmed transactions that have gone
+     * unseen for longer than the timeout given to the constructor.
+     * This only visits the transactions that are due.
+     * @return the hashes of the forgotten transactions.
+     */
+    BC_API std::vector<bc::hash_digest> expire(time_t now);
+
+    /**
+     * Debug dump to show db contents. This writes a chunk of rows at a
+     * time, in the same way as export_rows.
      */
     BC_API void dump(std::ostream& out);
 
+    /**
+     * Writes the rows that pass `filter` to a stream, in a format meant
+     * for other programs to read. Each chunk of about 64 KiB is built
+     * under a shared lock of its own, then written once it is let go,
+     * so a slow stream does not hold up changes. Rows changed or
+     * forgotten meanwhile are written as they are when their chunk is
+     * reached, and rows added meanwhile are left out. Check the stream
+     * for errors after.
+     */
+    BC_API void export_rows(std::ostream& out, export_format format,
+        const export_filter& filter=export_filter());
+
     /**
      * Insert a new transaction into the database.
      * @return true if the callback should be fired.
      */
     BC_API bool insert(const bc::transaction_type &tx, tx_state state);
 
+    /**
+     * Insert a batch of transactions, taking the lock only once.
+     * Large batches are hashed on several threads.
+     * @return the hashes of the transactions that were new, in order.
+     */
+    BC_API std::vector<bc::hash_digest> insert_many(
+        const std::vector<tx_insert>& txs);
+
+    /**
+     * Turn timing of locks and method calls on or off. This is off to
+     * begin with, so the only cost is a flag check per call. Turning it
+     * on again continues from the totals already collected.
+     */
+    BC_API void enable_stats(bool enable=true);
+
+    /**
+     * Returns the current sizes of the database, along with the timings
+     * collected while metrics were on.
+     */
+    BC_API tx_db_stats stats();
+
 private:
     // - Updater: ----------------------
     friend class tx_updater;
 
     /**
-     * Updates the block height.
+     * Updates the block height. If the previous block's header never
+     * arrived, or the height jumps too far for the recent headers to
+     * reach, the transactions in the block below are marked for
+     * checking instead, as if the chain might have forked.
      */
     void at_height(size_t height);
 
     /**
-     * Mark a transaction as confirmed.
-     * TODO: Require the block hash as well, once obelisk provides this.
+     * Records a block header at the given height, to catch reorgs.
+     * Transactions confirmed in any block that this replaces go back to
+     * unconfirmed.
+     * @return true if the header's parent did not match a known block,
+     * while older ones are known, so the header below it should be
+     * checked next.
+     */
+    bool add_header(size_t height, const bc::block_header_type& header);
+
+    /**
+     * Mark a transaction as confirmed. The block hash is filled in from
+     * the recent headers, if the block is among them, or else once its
+     * header arrives. This does nothing if the transaction is gone, as
+     * happens when expiry forgets it while a query is still out.
      */
     void confirmed(bc::hash_digest tx_hash, size_t block_height);
 
     /**
-     * Mark a transaction as unconfirmed.
+     * Mark a transaction as unconfirmed, if it is still there.
      */
     void unconfirmed(bc::hash_digest tx_hash);
 
@@ -153,44 +600,46 @@ private:
     BC_API void foreach_unconfirmed(hash_fn&& f);
     BC_API void foreach_forked(hash_fn&& f);
 
-    typedef std::function<void (const bc::transaction_type& tx)> tx_fn;
     BC_API void foreach_unsent(tx_fn&& f);
 
     // - Internal: ---------------------
-    void check_fork(size_t height);
-
-    // Guards access to object state:
-    std::mutex mutex_;
-
-    // The last block seen on the network:
-    size_t last_height_;
-
-    /**
-     * A single row in the transaction database.
-     */
-    struct tx_row
-    {
-        // The transaction itself:
-        bc::transaction_type tx;
-
-        // State machine:
-        tx_state state;
-        size_t block_height;
-        time_t timestamp;
-        //bc::hash_digest block_hash; // TODO: Fix obelisk to return this
-
-        // The transaction is certainly in a block, but there is some
-        // question whether or not that block is on the main chain:
-        bool need_check;
-    };
-    std::unordered_map<bc::hash_digest, tx_row> rows_;
+    tx_table& writable();
+    void log(const std::function<void ()>& release,
+        const std::vector<bc::data_chunk>& records);
+    std::unique_lock<std::mutex> quiet_journal();
+
+    // Guards access to object state. Read-only queries can run in
+    // parallel with each other, but not with changes:
+    boost::shared_mutex mutex_;
+
+    // The database contents. This is shared with any outstanding
+    // snapshots, and gets copied before changing if so:
+    std::shared_ptr<tx_table> table_;
+
+    // Changes are logged here, when journaling is on:
+    std::unique_ptr<tx_journal> journal_;
+
+    // Journal writes happen after the database lock is let go, so
+    // they take turns in the order their changes were made. Each change
+    // takes a ticket from `journal_next_` under the database lock, then
+    // waits for `journal_done_` to reach it under `journal_mutex_`.
+    // Opening or compacting the journal needs both locks:
+    std::mutex journal_mutex_;
+    std::condition_variable journal_turn_;
+    size_t journal_next_;
+    size_t journal_done_;
+
+    // The number of times a change had to copy the table, for stats():
+    size_t copies_;
+
+    // Timings for stats(), when turned on:
+    std::unique_ptr<tx_metrics> metrics_;
 
     // Number of seconds an unconfirmed transaction must remain unseen
-    // before we stop saving it:
+    // before `expire` forgets it:
     const unsigned unconfirmed_timeout_;
 };
 
 } // namespace libwallet
 
 #endif
-
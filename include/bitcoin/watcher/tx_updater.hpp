@@ -87,9 +87,11 @@ private:
     void get_inputs(const bc::transaction_type& tx);
     void query_done();
     void queue_get_indices();
+    void check_unconfirmed();
 
     // Server queries:
     void get_height();
+    void get_header(size_t height);
     void get_tx(bc::hash_digest tx_hash, bool want_inputs);
     void get_tx_mem(bc::hash_digest tx_hash, bool want_inputs);
     void get_index(bc::hash_digest tx_hash);
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_FLAT_MAP_HPP
+#define LIBBITCOIN_WATCHER_FLAT_MAP_HPP
+
+#include <bitcoin/bitcoin.hpp>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace libwallet {
+
+/**
+ * Hashes a digest by reading off its first few bytes, which are as
+ * random as the rest.
+ */
+struct digest_hash
+{
+    size_t operator()(const bc::hash_digest& digest) const
+    {
+        size_t out;
+        std::memcpy(&out, digest.data(), sizeof(out));
+        return out;
+    }
+};
+
+/**
+ * Hashes an output point. The index is spread out, so that the outputs
+ * of one transaction do not land in neighbouring slots.
+ */
+struct point_hash
+{
+    size_t operator()(const bc::output_point& point) const
+    {
+        return digest_hash()(point.hash) ^
+            point.index * size_t(0x9e3779b97f4a7c15);
+    }
+};
+
+/**
+ * A hash table that keeps its entries in one flat array, rather than
+ * allocating a node for each one.
+ *
+ * Lookups probe linearly from the key's home slot, and erasing shifts
+ * the entries after it back, so no tombstones are left behind. This
+ * only works well for keys whose hashes are already uniform, such as
+ * transaction hashes.
+ *
+ * Unlike std::unordered_map, adding a key can move every entry, which
+ * invalidates all iterators and references. Erasing invalidates them
+ * too. Both types must be default-constructible, since empty slots hold
+ * default values.
+ */
+template <typename Key, typename Value, typename Hash>
+class flat_map
+{
+public:
+    typedef std::pair<Key, Value> value_type;
+
+    template <typename Map, typename Entry>
+    class basic_iterator
+    {
+    public:
+        basic_iterator(Map* map, size_t index)
+          : map_(map), index_(index)
+        {
+            skip();
+        }
+
+        Entry& operator*() const
+        {
+            return map_->slots_[index_];
+        }
+        Entry* operator->() const
+        {
+            return &map_->slots_[index_];
+        }
+        basic_iterator& operator++()
+        {
+            ++index_;
+            skip();
+            return *this;
+        }
+        bool operator==(const basic_iterator& other) const
+        {
+            return index_ == other.index_;
+        }
+        bool operator!=(const basic_iterator& other) const
+        {
+            return index_ != other.index_;
+        }
+
+    private:
+        friend class flat_map;
+
+        // Moves past any empty slots:
+        void skip()
+        {
+            while (index_ < map_->used_.size() && !map_->used_[index_])
+                ++index_;
+        }
+
+        Map* map_;
+        size_t index_;
+    };
+    typedef basic_iterator<flat_map, value_type> iterator;
+    typedef basic_iterator<const flat_map, const value_type> const_iterator;
+
+    flat_map()
+      : size_(0)
+    {
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+    bool empty() const
+    {
+        return !size_;
+    }
+
+    /**
+     * The number of slots, used or not.
+     */
+    size_t capacity() const
+    {
+        return used_.size();
+    }
+
+    iterator begin()
+    {
+        return iterator(this, 0);
+    }
+    iterator end()
+    {
+        return iterator(this, capacity());
+    }
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+    const_iterator end() const
+    {
+        return const_iterator(this, capacity());
+    }
+
+    iterator find(const Key& key)
+    {
+        return iterator(this, lookup(key));
+    }
+    const_iterator find(const Key& key) const
+    {
+        return const_iterator(this, lookup(key));
+    }
+    size_t count(const Key& key) const
+    {
+        return lookup(key) != capacity();
+    }
+
+    /**
+     * Finds the value for a key, adding a default one if it is missing.
+     */
+    Value& operator[](const Key& key)
+    {
+        auto i = lookup(key);
+        if (i != capacity())
+            return slots_[i].second;
+
+        if (full())
+            grow(2 * capacity());
+        i = home(key);
+        while (used_[i])
+            i = next(i);
+        used_[i] = true;
+        slots_[i].first = key;
+        ++size_;
+        return slots_[i].second;
+    }
+
+    void erase(iterator position)
+    {
+        auto hole = position.index_;
+        used_[hole] = false;
+        --size_;
+
+        // Shift back any entries that the hole would hide from lookups:
+        auto mask = capacity() - 1;
+        for (auto i = next(hole); used_[i]; i = next(i))
+        {
+            auto distance = (i - home(slots_[i].first)) & mask;
+            if (distance < ((i - hole) & mask))
+                continue;
+
+            slots_[hole] = std::move(slots_[i]);
+            used_[hole] = true;
+            used_[i] = false;
+            hole = i;
+        }
+        slots_[hole] = value_type();
+    }
+    size_t erase(const Key& key)
+    {
+        auto i = find(key);
+        if (i == end())
+            return 0;
+        erase(i);
+        return 1;
+    }
+
+    void clear()
+    {
+        slots_.clear();
+        used_.clear();
+        size_ = 0;
+    }
+
+    /**
+     * Makes room for `count` entries without further growth.
+     */
+    void reserve(size_t count)
+    {
+        auto slots = min_slots;
+        while (slots - slots / 4 < count)
+            slots *= 2;
+        if (capacity() < slots)
+            grow(slots);
+    }
+
+private:
+    // Tables grow once three quarters of their slots are used:
+    static constexpr size_t min_slots = 16;
+    bool full() const
+    {
+        return capacity() - capacity() / 4 <= size_;
+    }
+
+    size_t home(const Key& key) const
+    {
+        return Hash()(key) & (capacity() - 1);
+    }
+    size_t next(size_t i) const
+    {
+        return (i + 1) & (capacity() - 1);
+    }
+
+    /**
+     * Returns the slot holding `key`, or the capacity if none does.
+     */
+    size_t lookup(const Key& key) const
+    {
+        if (!size_)
+            return capacity();
+        for (auto i = home(key); used_[i]; i = next(i))
+            if (slots_[i].first == key)
+                return i;
+        return capacity();
+    }
+
+    void grow(size_t slots)
+    {
+        if (slots < min_slots)
+            slots = min_slots;
+        std::vector<value_type> old_slots(slots);
+        std::vector<uint8_t> old_used(slots, 0);
+        old_slots.swap(slots_);
+        old_used.swap(used_);
+
+        for (size_t j = 0; j < old_used.size(); ++j)
+        {
+            if (!old_used[j])
+                continue;
+            auto i = home(old_slots[j].first);
+            while (used_[i])
+                i = next(i);
+            slots_[i] = std::move(old_slots[j]);
+            used_[i] = true;
+        }
+    }
+
+    std::vector<value_type> slots_;
+    std::vector<uint8_t> used_;
+    size_t size_;
+};
+
+} // namespace libwallet
+
+#endif
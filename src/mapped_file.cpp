@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "mapped_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace libwallet {
+
+mapped_file::~mapped_file()
+{
+    close();
+}
+
+mapped_file::mapped_file()
+  : data_(nullptr), size_(0)
+{
+}
+
+bool mapped_file::open(const std::string& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || !info.st_size)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed:
+    size_t size = info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == data)
+        return false;
+
+    // We read the file front to back:
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    data_ = static_cast<const uint8_t*>(data);
+    size_ = size;
+    return true;
+}
+
+void mapped_file::drop_pages()
+{
+    if (data_)
+        madvise(const_cast<uint8_t*>(data_), size_, MADV_DONTNEED);
+}
+
+void mapped_file::close()
+{
+    if (data_)
+        munmap(const_cast<uint8_t*>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+} // namespace libwallet
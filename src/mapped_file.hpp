@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_MAPPED_FILE_HPP
+#define LIBBITCOIN_WATCHER_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace libwallet {
+
+/**
+ * A read-only memory mapping of a whole file.
+ * The mapping goes away when this object does.
+ */
+class mapped_file
+{
+public:
+    ~mapped_file();
+    mapped_file();
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    /**
+     * Maps the file at `path`, replacing any earlier mapping.
+     * Returns false if the file cannot be opened or mapped.
+     */
+    bool open(const std::string& path);
+    void close();
+
+    /**
+     * Lets the kernel drop the mapped pages from memory.
+     * They are read back from the file if touched again.
+     */
+    void drop_pages();
+
+    const uint8_t* data() const
+    {
+        return data_;
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+};
+
+} // namespace libwallet
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "parallel.hpp"
+
+namespace libwallet {
+
+worker_pool::worker_pool(size_t threads)
+  : stop_(false), job_(0), f_(nullptr), count_(0), slice_(1), next_(0),
+    pending_(0)
+{
+    for (size_t i = 1; i < threads; ++i)
+        threads_.emplace_back(&worker_pool::work, this);
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread: threads_)
+        thread.join();
+}
+
+void worker_pool::run(size_t count, size_t min_slice, const slice_fn& f)
+{
+    size_t slices = std::min(threads_.size() + 1,
+        count / std::max<size_t>(min_slice, 1));
+    if (slices < 2)
+    {
+        f(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++job_;
+        f_ = &f;
+        count_ = count;
+        slice_ = (count + slices - 1) / slices;
+        next_ = 0;
+        pending_ = (count + slice_ - 1) / slice_;
+    }
+    start_.notify_all();
+    take_slices();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]
+    {
+        return !pending_;
+    });
+    f_ = nullptr;
+}
+
+void worker_pool::work()
+{
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        start_.wait(lock, [this, &seen]
+        {
+            return stop_ || seen != job_;
+        });
+        if (stop_)
+            return;
+        seen = job_;
+
+        lock.unlock();
+        take_slices();
+        lock.lock();
+    }
+}
+
+/**
+ * Runs slices of the current job until none are left to hand out.
+ */
+void worker_pool::take_slices()
+{
+    while (true)
+    {
+        size_t begin, end;
+        const slice_fn* f;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (count_ <= next_)
+                return;
+            begin = next_;
+            end = std::min(begin + slice_, count_);
+            next_ = end;
+            f = f_;
+        }
+
+        (*f)(begin, end);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!--pending_)
+            done_.notify_all();
+    }
+}
+
+} // namespace libwallet
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_PARALLEL_HPP
+#define LIBBITCOIN_WATCHER_PARALLEL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace libwallet {
+
+typedef std::function<void (size_t begin, size_t end)> slice_fn;
+
+/**
+ * Calls `f` on consecutive slices of the range [0, count), spread over
+ * the machine's cores, and waits for them all. Each slice holds at
+ * least `min_slice` items, since small slices are not worth a thread.
+ * The calling thread takes the first slice itself.
+ *
+ * This starts fresh threads on every call. Callers that split up work
+ * many times over should keep a worker_pool instead.
+ */
+inline void parallel_for(size_t count, size_t min_slice, const slice_fn& f)
+{
+    size_t threads = std::thread::hardware_concurrency();
+    threads = std::min(threads, count / std::max<size_t>(min_slice, 1));
+    if (threads < 2)
+    {
+        f(0, count);
+        return;
+    }
+
+    size_t slice = (count + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (size_t begin = slice; begin < count; begin += slice)
+        workers.emplace_back(f, begin, std::min(begin + slice, count));
+    f(0, slice);
+    for (auto& worker: workers)
+        worker.join();
+}
+
+/**
+ * A set of threads that stay parked between jobs, so work that comes
+ * in many rounds pays for starting them only once.
+ */
+class worker_pool
+{
+public:
+    /**
+     * Starts enough threads to use `threads` cores, counting the one
+     * that calls `run`. Asking for one or none starts nothing.
+     */
+    explicit worker_pool(size_t threads);
+    ~worker_pool();
+    worker_pool(const worker_pool&) = delete;
+    void operator=(const worker_pool&) = delete;
+
+    /**
+     * Like parallel_for, but on the pool's threads. The calling thread
+     * works through slices too, and this returns once all are done.
+     */
+    void run(size_t count, size_t min_slice, const slice_fn& f);
+
+private:
+    void work();
+    void take_slices();
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    bool stop_;
+
+    // The job in progress, which changes only while no slices are out:
+    uint64_t job_;
+    const slice_fn* f_;
+    size_t count_;
+    size_t slice_;
+    size_t next_;
+    size_t pending_;
+};
+
+} // namespace libwallet
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "row_arena.hpp"
+
+namespace libwallet {
+
+constexpr size_t row_arena::block_size;
+
+row_arena::row_arena()
+  : next_(nullptr), end_(nullptr)
+{
+}
+
+void* row_arena::allocate(size_t size, size_t align)
+{
+    auto address = reinterpret_cast<uintptr_t>(next_);
+    address = (address + align - 1) & ~(align - 1);
+    auto start = reinterpret_cast<uint8_t*>(address);
+    if (next_ && start + size <= end_)
+    {
+        next_ = start + size;
+        return start;
+    }
+
+    // Big pieces get a block of their own, rather than wasting the rest
+    // of the current one:
+    if (block_size / 4 < size)
+    {
+        blocks_.emplace_back(new uint8_t[size]);
+        return blocks_.back().get();
+    }
+
+    // Fresh blocks are aligned for anything:
+    blocks_.emplace_back(new uint8_t[block_size]);
+    start = blocks_.back().get();
+    next_ = start + size;
+    end_ = start + block_size;
+    return start;
+}
+
+} // namespace libwallet
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_ROW_ARENA_HPP
+#define LIBBITCOIN_WATCHER_ROW_ARENA_HPP
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace libwallet {
+
+/**
+ * Hands out memory in pieces carved from a few large blocks, instead of
+ * making a heap allocation for each piece. Freeing a piece does
+ * nothing; the blocks are released together once the arena goes away.
+ *
+ * This is not thread-safe, so only one thread may allocate at a time.
+ */
+class row_arena
+{
+public:
+    row_arena();
+    row_arena(const row_arena&) = delete;
+    void operator=(const row_arena&) = delete;
+
+    void* allocate(size_t size, size_t align);
+
+private:
+    static constexpr size_t block_size = 64 * 1024;
+
+    std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+    uint8_t* next_;
+    uint8_t* end_;
+};
+
+/**
+ * A standard allocator drawing from a row_arena, or from the heap if it
+ * has no arena. Every copy keeps its arena alive, so containers and
+ * shared pointers using it can safely outlive whatever created them.
+ */
+template <typename T>
+class arena_allocator
+{
+public:
+    typedef T value_type;
+
+    // Moving a container moves its memory along with it:
+    typedef std::true_type propagate_on_container_move_assignment;
+
+    // Copies go on the heap instead. An arena never frees anything, so
+    // copying into it, as happens whenever a change copies a table that
+    // a snapshot holds, would grow it for as long as it lives:
+    arena_allocator select_on_container_copy_construction() const
+    {
+        return arena_allocator();
+    }
+
+    arena_allocator()
+    {
+    }
+    explicit arena_allocator(std::shared_ptr<row_arena> arena)
+      : arena_(std::move(arena))
+    {
+    }
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other)
+      : arena_(other.arena())
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        if (!arena_)
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        return static_cast<T*>(
+            arena_->allocate(count * sizeof(T), alignof(T)));
+    }
+    void deallocate(T* data, size_t)
+    {
+        if (!arena_)
+            ::operator delete(data);
+    }
+
+    const std::shared_ptr<row_arena>& arena() const
+    {
+        return arena_;
+    }
+
+private:
+    std::shared_ptr<row_arena> arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b)
+{
+    return a.arena() == b.arena();
+}
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b)
+{
+    return a.arena() != b.arena();
+}
+
+} // namespace libwallet
+
+#endif
@@ -17,413 +17,865 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <bitcoin/watcher/tx_db.hpp>
+#include <boost/thread/locks.hpp>
+#include <cstdio>
+#include <fstream>
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "tx_journal.hpp"
+#include "tx_metrics.hpp"
+#include "tx_table.hpp"
 
 namespace libwallet {
 
-// Serialization stuff:
-constexpr uint32_t old_serial_magic = 0x3eab61c3; // From the watcher
-constexpr uint32_t serial_magic = 0xfecdb760;
-constexpr uint8_t serial_tx = 0x42;
+// Queries share the database lock, while changes hold it exclusively.
+// Both time themselves when metrics are on:
+class read_lock
+  : public timed_lock<boost::shared_lock<boost::shared_mutex>>
+{
+public:
+    read_lock(boost::shared_mutex& mutex, tx_metrics& metrics)
+      : timed_lock(mutex, metrics, metrics.shared_wait, metrics.shared_hold)
+    {
+    }
+};
+class write_lock
+  : public timed_lock<boost::unique_lock<boost::shared_mutex>>
+{
+public:
+    write_lock(boost::shared_mutex& mutex, tx_metrics& metrics)
+      : timed_lock(mutex, metrics, metrics.unique_wait, metrics.unique_hold)
+    {
+    }
+};
+
+/**
+ * Lets a write lock go, for `tx_db::log` to call once it has taken its
+ * ticket.
+ */
+static std::function<void ()> release(write_lock& lock)
+{
+    return [&lock]()
+    {
+        lock.unlock();
+    };
+}
+
+// Journal record types:
+constexpr uint8_t journal_insert = 1;
+constexpr uint8_t journal_height = 2;
+constexpr uint8_t journal_confirmed = 3;
+constexpr uint8_t journal_unconfirmed = 4;
+constexpr uint8_t journal_forget = 5;
+constexpr uint8_t journal_header = 6;
+
+// Batches smaller than this are hashed on the calling thread alone:
+constexpr size_t min_hash_slice = 256;
+
+static bc::data_chunk insert_record(const bc::transaction_type& tx,
+    tx_state state)
+{
+    bc::data_chunk out(2 + satoshi_raw_size(tx));
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_byte(journal_insert);
+    serial.write_byte(static_cast<uint8_t>(state));
+    satoshi_save(tx, serial.iterator());
+    return out;
+}
+
+static bc::data_chunk height_record(size_t height)
+{
+    bc::data_chunk out(1 + 8);
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_byte(journal_height);
+    serial.write_8_bytes(height);
+    return out;
+}
+
+static bc::data_chunk hash_record(uint8_t type, bc::hash_digest tx_hash)
+{
+    bc::data_chunk out(1 + 32);
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_byte(type);
+    serial.write_hash(tx_hash);
+    return out;
+}
+
+static bc::data_chunk confirmed_record(bc::hash_digest tx_hash,
+    size_t block_height)
+{
+    bc::data_chunk out(1 + 32 + 8);
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_byte(journal_confirmed);
+    serial.write_hash(tx_hash);
+    serial.write_8_bytes(block_height);
+    return out;
+}
+
+static bc::data_chunk header_record(size_t height,
+    bc::hash_digest block_hash, bc::hash_digest previous)
+{
+    bc::data_chunk out(1 + 8 + 32 + 32);
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_byte(journal_header);
+    serial.write_8_bytes(height);
+    serial.write_hash(block_hash);
+    serial.write_hash(previous);
+    return out;
+}
+
+
+/**
+ * Applies a journal record to a table.
+ * The base snapshot can be newer than some of the records, if a crash
+ * interrupted a compaction, so this tolerates rows that are already
+ * present or already gone. Every change sets absolute values, so
+ * replaying a record twice leaves the same result.
+ */
+static void apply_record(tx_table& table, const uint8_t* data, size_t size)
+{
+    const uint8_t* end = data + size;
+    auto serial = bc::make_deserializer(data, end);
+    try
+    {
+        switch (serial.read_byte())
+        {
+        case journal_insert:
+            {
+                auto state = serial.read_byte();
+                if (!is_tx_state(state))
+                    break;
+                bc::transaction_type tx;
+                bc::satoshi_load(serial.iterator(), end, tx);
+                table.insert(tx, static_cast<tx_state>(state));
+            }
+            break;
+        case journal_height:
+            table.at_height(serial.read_8_bytes());
+            break;
+        case journal_confirmed:
+            {
+                auto tx_hash = serial.read_hash();
+                auto block_height = serial.read_8_bytes();
+                table.confirmed(tx_hash, block_height);
+            }
+            break;
+        case journal_unconfirmed:
+            {
+                table.unconfirmed(serial.read_hash());
+            }
+            break;
+        case journal_forget:
+            table.forget(serial.read_hash());
+            break;
+        case journal_header:
+            {
+                auto height = serial.read_8_bytes();
+                auto block_hash = serial.read_hash();
+                table.add_header(height, block_hash, serial.read_hash());
+            }
+            break;
+        }
+    }
+    catch (bc::end_of_stream)
+    {
+        // The checksum matched, so this is a newer record type or a bug.
+        // Either way, skipping it is the best we can do.
+    }
+}
+
+BC_API tx_snapshot::~tx_snapshot()
+{
+}
+
+tx_snapshot::tx_snapshot(std::shared_ptr<const tx_table> table)
+  : table_(std::move(table))
+{
+}
+
+size_t tx_snapshot::last_height() const
+{
+    return table_->last_height();
+}
+
+bool tx_snapshot::has_tx(bc::hash_digest tx_hash) const
+{
+    return table_->has_tx(tx_hash);
+}
+
+bc::transaction_type tx_snapshot::get_tx(bc::hash_digest tx_hash) const
+{
+    return table_->get_tx(tx_hash);
+}
+
+bool tx_snapshot::with_tx(bc::hash_digest tx_hash, const tx_fn& f) const
+{
+    auto tx = table_->find_tx(tx_hash);
+    if (!tx)
+        return false;
+    f(*tx);
+    return true;
+}
+
+bool tx_snapshot::get_output(const bc::output_point& point,
+    bc::transaction_output_type& out) const
+{
+    return table_->get_output(point, out);
+}
+
+size_t tx_snapshot::get_tx_height(bc::hash_digest tx_hash) const
+{
+    return table_->get_tx_height(tx_hash);
+}
+
+bool tx_snapshot::is_spend(bc::hash_digest tx_hash,
+    const address_set& addresses) const
+{
+    return table_->is_spend(tx_hash, addresses);
+}
+
+bool tx_snapshot::has_history(const bc::payment_address& address) const
+{
+    return table_->has_history(address);
+}
+
+std::vector<bc::hash_digest> tx_snapshot::get_address_txs(
+    const bc::payment_address& address) const
+{
+    return table_->get_address_txs(address);
+}
+
+history_list tx_snapshot::get_history(const bc::payment_address& address,
+    size_t from_height, size_t limit, bc::hash_digest cursor) const
+{
+    return table_->get_history(address, from_height, limit, cursor);
+}
+
+bc::hash_digest tx_snapshot::get_spender(
+    const bc::output_point& point) const
+{
+    return table_->get_spender(point);
+}
+
+std::vector<bc::hash_digest> tx_snapshot::get_conflicts(
+    bc::hash_digest tx_hash) const
+{
+    return table_->get_conflicts(tx_hash);
+}
+
+bc::output_info_list tx_snapshot::get_utxos() const
+{
+    return table_->get_utxos();
+}
+
+bc::output_info_list tx_snapshot::get_utxos(
+    const address_set& addresses) const
+{
+    return table_->get_utxos(addresses);
+}
+
+address_balance tx_snapshot::get_balance(
+    const address_set& addresses) const
+{
+    return table_->get_balance(addresses);
+}
+
+void tx_snapshot::dump(std::ostream& out) const
+{
+    table_->dump(out);
+}
+
+void tx_snapshot::export_rows(std::ostream& out, export_format format,
+    const export_filter& filter) const
+{
+    table_->export_rows(out, format, filter);
+}
 
 BC_API tx_db::~tx_db()
 {
 }
 
 BC_API tx_db::tx_db(unsigned unconfirmed_timeout)
-  : last_height_(0),
+  : table_(std::make_shared<tx_table>()),
+    journal_(new tx_journal()),
+    journal_next_(0),
+    journal_done_(0),
+    copies_(0),
+    metrics_(new tx_metrics()),
     unconfirmed_timeout_(unconfirmed_timeout)
 {
 }
 
+tx_snapshot tx_db::snapshot()
+{
+    timed_call call(*metrics_, metric_call::snapshot);
+    read_lock lock(mutex_, *metrics_);
+
+    return tx_snapshot(table_);
+}
+
 size_t tx_db::last_height()
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::last_height);
+    read_lock lock(mutex_, *metrics_);
 
-    return last_height_;
+    return table_->last_height();
 }
 
 bool tx_db::has_tx(bc::hash_digest tx_hash)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::has_tx);
+    read_lock lock(mutex_, *metrics_);
 
-    return rows_.find(tx_hash) != rows_.end();
+    return table_->has_tx(tx_hash);
 }
 
 bc::transaction_type tx_db::get_tx(bc::hash_digest tx_hash)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::get_tx);
+    read_lock lock(mutex_, *metrics_);
+
+    return table_->get_tx(tx_hash);
+}
+
+bool tx_db::with_tx(bc::hash_digest tx_hash, const tx_fn& f)
+{
+    timed_call call(*metrics_, metric_call::with_tx);
+
+    // Rows never change their transaction in place, so holding a
+    // reference keeps it valid once the lock is gone:
+    std::shared_ptr<const bc::transaction_type> tx;
+    {
+        read_lock lock(mutex_, *metrics_);
+        tx = table_->find_tx(tx_hash);
+    }
+    if (!tx)
+        return false;
+    f(*tx);
+    return true;
+}
+
+bool tx_db::get_output(const bc::output_point& point,
+    bc::transaction_output_type& out)
+{
+    timed_call call(*metrics_, metric_call::get_output);
+    read_lock lock(mutex_, *metrics_);
 
-    auto i = rows_.find(tx_hash);
-    if (i == rows_.end())
-        return bc::transaction_type();
-    return i->second.tx;
+    return table_->get_output(point, out);
 }
 
 size_t tx_db::get_tx_height(bc::hash_digest tx_hash)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::get_tx_height);
+    read_lock lock(mutex_, *metrics_);
 
-    auto i = rows_.find(tx_hash);
-    if (i == rows_.end())
-        return 0;
-    if (i->second.state != tx_state::confirmed)
-        return 0;
-    return i->second.block_height;
+    return table_->get_tx_height(tx_hash);
 }
 
 bool tx_db::is_spend(bc::hash_digest tx_hash, const address_set& addresses)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::is_spend);
+    read_lock lock(mutex_, *metrics_);
 
-    auto i = rows_.find(tx_hash);
-    if (i == rows_.end())
-        return false;
-    auto tx = i->second.tx;
-
-    for (auto& input: tx.inputs)
-    {
-        bc::payment_address address;
-        if (!bc::extract(address, input.script))
-            return false;
-        if (addresses.find(address) == addresses.end())
-            return false;
-    }
-    return true;
+    return table_->is_spend(tx_hash, addresses);
 }
 
 bool tx_db::has_history(const bc::payment_address& address)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::has_history);
+    read_lock lock(mutex_, *metrics_);
 
-    for (auto& row: rows_)
-    {
-        for (auto& output: row.second.tx.outputs)
-        {
-            bc::payment_address to_address;
-            if (bc::extract(to_address, output.script))
-                if (address == to_address)
-                    return true;
-        }
-    }
+    return table_->has_history(address);
+}
+
+std::vector<bc::hash_digest> tx_db::get_address_txs(
+    const bc::payment_address& address)
+{
+    timed_call call(*metrics_, metric_call::get_address_txs);
+    read_lock lock(mutex_, *metrics_);
+
+    return table_->get_address_txs(address);
+}
+
+history_list tx_db::get_history(const bc::payment_address& address,
+    size_t from_height, size_t limit, bc::hash_digest cursor)
+{
+    timed_call call(*metrics_, metric_call::get_history);
+    read_lock lock(mutex_, *metrics_);
 
-    return false;
+    return table_->get_history(address, from_height, limit, cursor);
+}
+
+bc::hash_digest tx_db::get_spender(const bc::output_point& point)
+{
+    timed_call call(*metrics_, metric_call::get_spender);
+    read_lock lock(mutex_, *metrics_);
+
+    return table_->get_spender(point);
+}
+
+std::vector<bc::hash_digest> tx_db::get_conflicts(bc::hash_digest tx_hash)
+{
+    timed_call call(*metrics_, metric_call::get_conflicts);
+    read_lock lock(mutex_, *metrics_);
+
+    return table_->get_conflicts(tx_hash);
 }
 
 bc::output_info_list tx_db::get_utxos()
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::get_utxos);
+    read_lock lock(mutex_, *metrics_);
 
-    // Allow inserting bc::output_point into std::set:
-    class point_cmp {
-    public:
-        bool operator () (const bc::output_point& a, const bc::output_point& b)
-        {
-            if (a.hash == b.hash)
-                return a.index < b.index;
-            else
-                return a.hash < b.hash;
-        }
-    };
+    return table_->get_utxos();
+}
+
+bc::output_info_list tx_db::get_utxos(const address_set& addresses)
+{
+    timed_call call(*metrics_, metric_call::get_utxos);
+    read_lock lock(mutex_, *metrics_);
+
+    return table_->get_utxos(addresses);
+}
+
+address_balance tx_db::get_balance(const address_set& addresses)
+{
+    timed_call call(*metrics_, metric_call::get_balance);
+    read_lock lock(mutex_, *metrics_);
 
-    // Build a list of spent outputs:
-    std::set<bc::output_point, point_cmp> spends;
-    for (auto& row: rows_)
-        for (auto& input: row.second.tx.inputs)
-            spends.insert(input.previous_output);
+    return table_->get_balance(addresses);
+}
 
-    // Check each output against the list:
-    bc::output_info_list out;
-    for (auto& row: rows_)
+bc::data_chunk tx_db::serialize(unsigned flags)
+{
+    timed_call call(*metrics_, metric_call::serialize);
+
+    // Copying the rows out is quick, so that happens under the lock,
+    // while compressing them waits until it is let go:
+    bc::data_chunk blob;
     {
-        for (uint32_t i = 0; i < row.second.tx.outputs.size(); ++i)
-        {
-            auto& output = row.second.tx.outputs[i];
-            bc::output_point point = {row.first, i};
-            if (spends.find(point) == spends.end())
-            {
-                bc::output_info_type info = {point, output.value};
-                out.push_back(info);
-            }
-        }
+        read_lock lock(mutex_, *metrics_);
+        blob = table_->serialize(0);
     }
-    return out;
+    if (flags & compress_rows)
+        return tx_table::compress(blob);
+    return blob;
 }
 
-bc::output_info_list tx_db::get_utxos(const address_set& addresses)
+void tx_db::serialize(std::ostream& out, unsigned flags)
 {
-    auto raw = get_utxos();
+    timed_call call(*metrics_, metric_call::serialize);
 
-    std::lock_guard<std::mutex> lock(mutex_);
-    bc::output_info_list utxos;
-    for (auto& utxo: raw)
+    // Rows stream out of a snapshot, so the lock is let go straight
+    // away and no copy of the blob builds up in memory:
+    std::shared_ptr<const tx_table> table;
     {
-        auto i = rows_.find(utxo.point.hash);
-        BITCOIN_ASSERT(i != rows_.end());
-        const auto& tx = i->second.tx;
-        auto& output = tx.outputs[utxo.point.index];
-
-        bc::payment_address to_address;
-        if (bc::extract(to_address, output.script))
-            if (addresses.find(to_address) != addresses.end())
-                utxos.push_back(utxo);
+        read_lock lock(mutex_, *metrics_);
+        table = table_;
     }
+    table->serialize(out, flags);
+}
 
-    return utxos;
+bool tx_db::load(const bc::data_chunk& data, unsigned flags)
+{
+    return load(data.data(), data.size(), flags);
 }
 
-bc::data_chunk tx_db::serialize()
+bool tx_db::load(const uint8_t* data, size_t size, unsigned flags)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::load);
 
-    std::basic_ostringstream<uint8_t> stream;
-    auto serial = bc::make_serializer(std::ostreambuf_iterator<uint8_t>(stream));
+    // Parse outside the lock, and only swap in the result if it is good:
+    auto table = std::make_shared<tx_table>();
+    if (!table->load(data, size, nullptr, flags))
+        return false;
 
-    // Magic version bytes:
-    serial.write_4_bytes(serial_magic);
+    write_lock lock(mutex_, *metrics_);
+    table_ = std::move(table);
+    return true;
+}
 
-    // Last block height:
-    serial.write_8_bytes(last_height_);
+bool tx_db::load_file(const std::string& path, unsigned flags)
+{
+    timed_call call(*metrics_, metric_call::load_file);
 
-    // Tx table:
-    time_t now = time(nullptr);
-    for (const auto& row: rows_)
-    {
-        // Don't save old unconfirmed transactions:
-        if (row.second.timestamp + unconfirmed_timeout_ < now)
-            continue;
+    auto file = std::make_shared<mapped_file>();
+    if (!file->open(path))
+        return false;
 
-        auto height = row.second.block_height;
-        if (tx_state::unconfirmed == row.second.state)
-            height = row.second.timestamp;
+    // Lazy rows keep pointing into the mapping, so it must outlive them:
+    std::shared_ptr<const void> backing;
+    if (flags & lazy_txs)
+        backing = file;
 
-        serial.write_byte(serial_tx);
-        serial.write_hash(row.first);
-        serial.set_iterator(satoshi_save(row.second.tx, serial.iterator()));
-        serial.write_byte(static_cast<uint8_t>(row.second.state));
-        serial.write_8_bytes(height);
-        serial.write_byte(row.second.need_check);
-    }
+    auto table = std::make_shared<tx_table>();
+    if (!table->load(file->data(), file->size(), backing, flags))
+        return false;
 
-    // The copy is not very elegant:
-    auto str = stream.str();
-    return bc::data_chunk(str.begin(), str.end());
+    // Parsing paged in the whole file, but few of those pages are
+    // needed again soon:
+    if (backing)
+        file->drop_pages();
+
+    write_lock lock(mutex_, *metrics_);
+    table_ = std::move(table);
+    return true;
 }
 
-bool tx_db::load(const bc::data_chunk& data)
+void tx_db::dump(std::ostream& out)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::dump);
+
+    // Each chunk of text is built under the lock, and written once it
+    // is let go, so a slow stream does not hold up changes:
+    std::vector<bc::hash_digest> hashes;
+    {
+        read_lock lock(mutex_, *metrics_);
+        hashes = table_->row_hashes();
+    }
+    std::string text;
+    size_t next = 0;
+    do
+    {
+        {
+            read_lock lock(mutex_, *metrics_);
+            next = table_->dump_chunk(text, hashes, next);
+        }
+        out.write(text.data(), text.size());
+        text.clear();
+    } while (next < hashes.size());
+    out.flush();
+}
 
-    auto serial = bc::make_deserializer(data.begin(), data.end());
-    size_t last_height;
-    std::unordered_map<bc::hash_digest, tx_row> rows;
+void tx_db::export_rows(std::ostream& out, export_format format,
+    const export_filter& filter)
+{
+    timed_call call(*metrics_, metric_call::export_rows);
 
-    try
+    std::vector<bc::hash_digest> hashes;
+    {
+        read_lock lock(mutex_, *metrics_);
+        hashes = table_->row_hashes();
+    }
+    std::string text;
+    for (size_t next = 0; next < hashes.size(); )
     {
-        // Header bytes:
-        auto magic = serial.read_4_bytes();
-        if (old_serial_magic == magic)
-            return true;
-        if (serial_magic != magic)
-            return false;
-
-        // Last block height:
-        last_height = serial.read_8_bytes();
-
-        time_t now = time(nullptr);
-        while (serial.iterator() != data.end())
         {
-            if (serial.read_byte() != serial_tx)
-                return false;
-
-            bc::hash_digest hash = serial.read_hash();
-            tx_row row;
-            bc::satoshi_load(serial.iterator(), data.end(), row.tx);
-            auto step = serial.iterator() + satoshi_raw_size(row.tx);
-            serial.set_iterator(step);
-            row.state = static_cast<tx_state>(serial.read_byte());
-            row.block_height = serial.read_8_bytes();
-            row.timestamp = now;
-            if (tx_state::unconfirmed == row.state)
-                row.timestamp = row.block_height;
-            row.need_check = serial.read_byte();
-            rows[hash] = std::move(row);
+            read_lock lock(mutex_, *metrics_);
+            next = table_->export_chunk(text, hashes, next, format,
+                filter);
         }
+        out.write(text.data(), text.size());
+        text.clear();
     }
-    catch (bc::end_of_stream)
+    out.flush();
+}
+
+bool tx_db::open_journal(const std::string& path)
+{
+    timed_call call(*metrics_, metric_call::open_journal);
+    write_lock lock(mutex_, *metrics_);
+    auto guard = quiet_journal();
+
+    auto& table = writable();
+    auto replay = [&table](const uint8_t* data, size_t size)
+    {
+        apply_record(table, data, size);
+    };
+    return journal_->open(path, replay);
+}
+
+bool tx_db::compact(const std::string& path, unsigned flags)
+{
+    timed_call call(*metrics_, metric_call::compact);
+
+    // Copy out the contents along with the journal position they match.
+    // No changes can take a journal ticket under the shared lock, so the
+    // position stays put once the earlier ones are written:
+    bc::data_chunk blob;
+    size_t offset, ticket;
     {
+        read_lock lock(mutex_, *metrics_);
+        auto guard = quiet_journal();
+        blob = table_->serialize(0);
+        offset = journal_->size();
+        ticket = journal_next_;
+    }
+
+    // Compress and write the new base snapshot without holding the lock:
+    if (flags & compress_rows)
+        blob = tx_table::compress(blob);
+    auto temp = path + ".tmp";
+    std::ofstream file(temp, std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(blob.data()), blob.size());
+    file.close();
+    if (!file || !tx_journal::sync_file(temp) ||
+        rename(temp.c_str(), path.c_str()) < 0)
+    {
+        remove(temp.c_str());
         return false;
     }
-    last_height_ = last_height;
-    rows_ = rows;
+
+    // Records must not be dropped before the snapshot's name is safely
+    // on disk:
+    if (!tx_journal::sync_dir(path))
+        return false;
+
+    // The snapshot covers everything up to the offset. If a failed
+    // append kept later changes out of the journal, only a snapshot
+    // that none were made after makes up for them:
+    write_lock lock(mutex_, *metrics_);
+    auto guard = quiet_journal();
+    if (!journal_->is_open())
+        return true;
+    return journal_->discard_before(offset, ticket == journal_next_);
+}
+
+bool tx_db::journal_failed()
+{
+    std::lock_guard<std::mutex> guard(journal_mutex_);
+    return journal_->failed();
+}
+
+bool tx_db::insert(const bc::transaction_type& tx, tx_state state)
+{
+    timed_call call(*metrics_, metric_call::insert);
+    write_lock lock(mutex_, *metrics_);
+
+    if (!writable().insert(tx, state))
+        return false;
+    if (journal_->is_open())
+        log(release(lock), {insert_record(tx, state)});
     return true;
 }
 
-void tx_db::dump(std::ostream& out)
+std::vector<bc::hash_digest> tx_db::insert_many(
+    const std::vector<tx_insert>& txs)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::insert_many);
 
-    out << "height: " << last_height_ << std::endl;
-    for (const auto& row: rows_)
+    // Hashing is the costly part, so do it before taking the lock:
+    std::vector<bc::hash_digest> hashes(txs.size());
+    size_t inputs = 0, outputs = 0;
+    for (const auto& tx: txs)
     {
-        out << "================" << std::endl;
-        out << "hash: " << bc::encode_hex(row.first) << std::endl;
-        std::string state;
-        switch (row.second.state)
-        {
-        case tx_state::unsent:
-            out << "state: unsent" << std::endl;
-            break;
-        case tx_state::unconfirmed:
-            out << "state: unconfirmed" << std::endl;
-            out << "timestamp: " << row.second.timestamp << std::endl;
-            break;
-        case tx_state::confirmed:
-            out << "state: confirmed" << std::endl;
-            out << "height: " << row.second.block_height << std::endl;
-            if (row.second.need_check)
-                out << "needs check." << std::endl;
-            break;
-        }
-        for (auto& input: row.second.tx.inputs)
-        {
-            bc::payment_address address;
-            if (bc::extract(address, input.script))
-                out << "input: " << address.encoded() << std::endl;
-        }
-        for (auto& output: row.second.tx.outputs)
+        inputs += tx.first.inputs.size();
+        outputs += tx.first.outputs.size();
+    }
+    parallel_for(txs.size(), min_hash_slice,
+        [&txs, &hashes](size_t begin, size_t end)
         {
-            bc::payment_address address;
-            if (bc::extract(address, output.script))
-                out << "output: " << address.encoded() << " " <<
-                    output.value << std::endl;
-        }
+            for (size_t i = begin; i < end; ++i)
+                hashes[i] = bc::hash_transaction(txs[i].first);
+        });
+
+    std::vector<bc::hash_digest> out;
+    std::vector<bc::data_chunk> records;
+    write_lock lock(mutex_, *metrics_);
+
+    auto& table = writable();
+    table.reserve(txs.size(), inputs, outputs);
+    for (size_t i = 0; i < txs.size(); ++i)
+    {
+        if (!table.insert(txs[i].first, hashes[i], txs[i].second))
+            continue;
+        out.push_back(hashes[i]);
+        if (journal_->is_open())
+            records.push_back(insert_record(txs[i].first, txs[i].second));
     }
+    log(release(lock), records);
+    return out;
 }
 
-bool tx_db::insert(const bc::transaction_type& tx, tx_state state)
+void tx_db::enable_stats(bool enable)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    metrics_->enable(enable);
+}
 
-    // Do not stomp existing tx's:
-    auto tx_hash = bc::hash_transaction(tx);
-    if (rows_.find(tx_hash) == rows_.end()) {
-        rows_[tx_hash] = tx_row{tx, state, 0, time(nullptr), false};
-        return true;
+tx_db_stats tx_db::stats()
+{
+    tx_db_stats out;
+
+    // Taking a snapshot would show up in the very metrics being read,
+    // so this locks plainly, and only for as long as the counting takes:
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        table_->get_sizes(out);
+        out.copies = copies_;
     }
-    return false;
+    metrics_->read(out);
+    return out;
 }
 
 void tx_db::at_height(size_t height)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    last_height_ = height;
+    timed_call call(*metrics_, metric_call::at_height);
+    write_lock lock(mutex_, *metrics_);
 
-    // Check for blockchain forks:
-    check_fork(height);
+    if (writable().at_height(height) && journal_->is_open())
+        log(release(lock), {height_record(height)});
 }
 
-void tx_db::confirmed(bc::hash_digest tx_hash, size_t block_height)
+bool tx_db::add_header(size_t height, const bc::block_header_type& header)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::add_header);
 
-    auto i = rows_.find(tx_hash);
-    BITCOIN_ASSERT(i != rows_.end());
-    auto& row = i->second;
+    auto block_hash = bc::hash_block_header(header);
+    write_lock lock(mutex_, *metrics_);
 
-    // If the transaction was already confirmed in another block,
-    // that means the chain has forked:
-    if (row.state == tx_state::confirmed && row.block_height != block_height)
-    {
-        //on_fork_();
-        check_fork(row.block_height);
-    }
+    bool deeper = writable().add_header(height, block_hash,
+        header.previous_block_hash);
+    if (journal_->is_open())
+        log(release(lock), {header_record(height, block_hash,
+            header.previous_block_hash)});
+    return deeper;
+}
+
+void tx_db::confirmed(bc::hash_digest tx_hash, size_t block_height)
+{
+    timed_call call(*metrics_, metric_call::confirmed);
+    write_lock lock(mutex_, *metrics_);
+
+    // Avoid copying a shared table when nothing changes:
+    if (!table_->would_confirm(tx_hash, block_height))
+        return;
 
-    row.state = tx_state::confirmed;
-    row.block_height = block_height;
+    writable().confirmed(tx_hash, block_height);
+    if (journal_->is_open())
+        log(release(lock), {confirmed_record(tx_hash, block_height)});
 }
 
 void tx_db::unconfirmed(bc::hash_digest tx_hash)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    auto i = rows_.find(tx_hash);
-    BITCOIN_ASSERT(i != rows_.end());
-    auto& row = i->second;
+    timed_call call(*metrics_, metric_call::unconfirmed);
+    write_lock lock(mutex_, *metrics_);
 
-    // If the transaction was already confirmed, and is now unconfirmed,
-    // we probably have a block fork:
-    if (row.state == tx_state::confirmed)
-    {
-        //on_fork_();
-        check_fork(row.block_height);
-    }
+    if (!table_->would_unconfirm(tx_hash))
+        return;
 
-    row.state = tx_state::unconfirmed;
+    writable().unconfirmed(tx_hash);
+    if (journal_->is_open())
+        log(release(lock), {hash_record(journal_unconfirmed, tx_hash)});
 }
 
 void tx_db::forget(bc::hash_digest tx_hash)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::forget);
+    write_lock lock(mutex_, *metrics_);
 
-    rows_.erase(tx_hash);
+    if (writable().forget(tx_hash) && journal_->is_open())
+        log(release(lock), {hash_record(journal_forget, tx_hash)});
 }
 
 void tx_db::reset_timestamp(bc::hash_digest tx_hash)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::reset_timestamp);
+    write_lock lock(mutex_, *metrics_);
+
+    if (table_->would_reset_timestamp(tx_hash))
+        writable().reset_timestamp(tx_hash);
+}
+
+std::vector<bc::hash_digest> tx_db::expire(time_t now)
+{
+    timed_call call(*metrics_, metric_call::expire);
+    write_lock lock(mutex_, *metrics_);
 
-    auto i = rows_.find(tx_hash);
-    if (i != rows_.end())
-        i->second.timestamp = time(nullptr);
+    // Avoid copying a shared table when nothing is due:
+    if (!table_->has_expired(now, unconfirmed_timeout_))
+        return std::vector<bc::hash_digest>();
+
+    auto out = writable().expire(now, unconfirmed_timeout_);
+    if (journal_->is_open())
+    {
+        std::vector<bc::data_chunk> records;
+        records.reserve(out.size());
+        for (const auto& tx_hash: out)
+            records.push_back(hash_record(journal_forget, tx_hash));
+        log(release(lock), records);
+    }
+    return out;
 }
 
 void tx_db::foreach_unconfirmed(hash_fn&& f)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::foreach_unconfirmed);
+    read_lock lock(mutex_, *metrics_);
 
-    for (auto row: rows_)
-        if (row.second.state != tx_state::confirmed)
-            f(row.first);
+    table_->foreach_unconfirmed(f);
 }
 
 void tx_db::foreach_forked(hash_fn&& f)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::foreach_forked);
+    read_lock lock(mutex_, *metrics_);
 
-    for (auto row: rows_)
-        if (row.second.state == tx_state::confirmed && row.second.need_check)
-            f(row.first);
+    table_->foreach_forked(f);
 }
 
 void tx_db::foreach_unsent(tx_fn&& f)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
+    timed_call call(*metrics_, metric_call::foreach_unsent);
+    read_lock lock(mutex_, *metrics_);
 
-    for (auto row: rows_)
-        if (row.second.state == tx_state::unsent)
-            f(row.second.tx);
+    table_->foreach_unsent(f);
+}
+
+/**
+ * Writes the records for a change made under the write lock, which
+ * `release` lets go. That happens first, so that nothing else waits on
+ * the disk, while the ticket taken under the lock keeps the records in
+ * the order of their changes. A failed write shows up in
+ * `journal_failed`.
+ */
+void tx_db::log(const std::function<void ()>& release,
+    const std::vector<bc::data_chunk>& records)
+{
+    if (records.empty())
+        return;
+    auto ticket = journal_next_++;
+    release();
+
+    std::unique_lock<std::mutex> guard(journal_mutex_);
+    journal_turn_.wait(guard,
+        [this, ticket]
+        {
+            return journal_done_ == ticket;
+        });
+    journal_->append(records);
+    ++journal_done_;
+    journal_turn_.notify_all();
 }
 
 /**
- * It is possible that the blockchain has forked. Therefore, mark all
- * transactions just below the given height as needing to be checked.
+ * Waits for every change already made to reach the journal, and keeps
+ * it from being written further until the returned lock goes away. The
+ * caller must hold the database lock, either way, so no more tickets
+ * are taken meanwhile.
  */
-void tx_db::check_fork(size_t height)
+std::unique_lock<std::mutex> tx_db::quiet_journal()
 {
-    // Find the height of next-lower block that has transactions in it:
-    size_t prev_height = 0;
-    for (auto row: rows_)
-        if (row.second.state == tx_state::confirmed &&
-            row.second.block_height < height &&
-            prev_height < row.second.block_height)
-            prev_height = row.second.block_height;
+    std::unique_lock<std::mutex> guard(journal_mutex_);
+    journal_turn_.wait(guard,
+        [this]
+        {
+            return journal_done_ == journal_next_;
+        });
+    return guard;
+}
 
-    // Mark all transactions at that level as needing checked:
-    for (auto row: rows_)
-        if (row.second.state == tx_state::confirmed &&
-            row.second.block_height == prev_height)
-            row.second.need_check = true;
+/**
+ * Returns the table for changing, first copying it if any snapshots
+ * are still looking at it. The caller must hold the lock exclusively.
+ */
+tx_table& tx_db::writable()
+{
+    if (!table_.unique())
+    {
+        table_ = std::make_shared<tx_table>(*table_);
+        ++copies_;
+    }
+    return *table_;
 }
 
 } // libwallet
-
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tx_journal.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace libwallet {
+
+// Each record starts with its payload length and checksum:
+constexpr size_t frame_size = 4 + 4;
+
+tx_journal::~tx_journal()
+{
+    close();
+}
+
+tx_journal::tx_journal()
+  : fd_(-1), size_(0), failed_(false)
+{
+}
+
+bool tx_journal::open(const std::string& path, const record_fn& replay)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return false;
+
+    // Journals are kept short by compaction, so just read it all:
+    bc::data_chunk data;
+    uint8_t buffer[65536];
+    ssize_t got;
+    while (0 < (got = read(fd, buffer, sizeof(buffer))))
+        data.insert(data.end(), buffer, buffer + got);
+    if (got < 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // Replay every intact record:
+    size_t good = 0;
+    while (frame_size <= data.size() - good)
+    {
+        auto serial = bc::make_deserializer(data.begin() + good, data.end());
+        size_t length = serial.read_4_bytes();
+        uint32_t checksum = serial.read_4_bytes();
+        if (data.size() - good - frame_size < length)
+            break;
+
+        auto first = data.begin() + good + frame_size;
+        bc::data_chunk record(first, first + length);
+        if (bc::bitcoin_checksum(record) != checksum)
+            break;
+
+        replay(record.data(), record.size());
+        good += frame_size + length;
+    }
+
+    // Cut off any torn record at the end:
+    if (good != data.size() && ftruncate(fd, good) < 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    if (lseek(fd, good, SEEK_SET) < 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    path_ = path;
+    fd_ = fd;
+    size_ = good;
+    failed_ = false;
+    return true;
+}
+
+void tx_journal::close()
+{
+    if (is_open())
+        ::close(fd_);
+    fd_ = -1;
+    size_ = 0;
+}
+
+bool tx_journal::append(const bc::data_chunk& record)
+{
+    return append(std::vector<bc::data_chunk>{record});
+}
+
+bool tx_journal::append(const std::vector<bc::data_chunk>& records)
+{
+    // After a failure, the change that went missing would leave a gap
+    // in the middle of the log, so nothing more goes in:
+    if (!is_open() || failed_)
+        return false;
+
+    size_t size = 0;
+    for (const auto& record: records)
+        size += frame_size + record.size();
+
+    bc::data_chunk frames(size);
+    auto serial = bc::make_serializer(frames.begin());
+    for (const auto& record: records)
+    {
+        serial.write_4_bytes(record.size());
+        serial.write_4_bytes(bc::bitcoin_checksum(record));
+        serial.write_data(record);
+    }
+
+    if (!write_all(fd_, frames.data(), frames.size()) || fdatasync(fd_) < 0)
+    {
+        // Cut off whatever made it out, so the journal still ends on a
+        // whole record. Replay stops at the first bad checksum, so a
+        // torn frame left here would hide every record after it:
+        if (0 == ftruncate(fd_, size_))
+            lseek(fd_, size_, SEEK_SET);
+        failed_ = true;
+        return false;
+    }
+    size_ += frames.size();
+    return true;
+}
+
+bool tx_journal::discard_before(size_t offset, bool caught_up)
+{
+    if (!is_open())
+        return false;
+    BITCOIN_ASSERT(offset <= size_);
+
+    // Read whatever was appended after the offset:
+    bc::data_chunk tail(size_ - offset);
+    if (tail.size() &&
+        pread(fd_, tail.data(), tail.size(), offset) !=
+            static_cast<ssize_t>(tail.size()))
+        return false;
+
+    // Write it to a new file, and swap that into place:
+    auto temp = path_ + ".tmp";
+    int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+    if (!write_all(fd, tail.data(), tail.size()) || fsync(fd) < 0 ||
+        rename(temp.c_str(), path_.c_str()) < 0)
+    {
+        ::close(fd);
+        unlink(temp.c_str());
+        return false;
+    }
+
+    // The rename only survives a crash once the directory is flushed.
+    // Even if that fails, the new file is already the journal:
+    bool synced = sync_dir(path_);
+
+    ::close(fd_);
+    fd_ = fd;
+    size_ = tail.size();
+    if (caught_up)
+        failed_ = false;
+    return synced;
+}
+
+bool tx_journal::sync_file(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = 0 <= fsync(fd);
+    ::close(fd);
+    return ok;
+}
+
+bool tx_journal::sync_dir(const std::string& path)
+{
+    auto slash = path.rfind('/');
+    std::string dir = ".";
+    if (0 == slash)
+        dir = "/";
+    else if (slash != std::string::npos)
+        dir = path.substr(0, slash);
+
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = 0 <= fsync(fd);
+    ::close(fd);
+    return ok;
+}
+
+bool tx_journal::write_all(int fd, const uint8_t* data, size_t size)
+{
+    while (size)
+    {
+        ssize_t wrote = write(fd, data, size);
+        if (wrote < 0 && EINTR == errno)
+            continue;
+        if (wrote < 0)
+            return false;
+        data += wrote;
+        size -= wrote;
+    }
+    return true;
+}
+
+} // namespace libwallet
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_TX_JOURNAL_HPP
+#define LIBBITCOIN_WATCHER_TX_JOURNAL_HPP
+
+#include <bitcoin/bitcoin.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace libwallet {
+
+/**
+ * An append-only log of database changes.
+ *
+ * Each record is framed with its length and a checksum, so a record
+ * torn by a crash is detected and dropped on the next open. The journal
+ * knows nothing about what the records mean; tx_db encodes and applies
+ * them.
+ */
+class tx_journal
+{
+public:
+    ~tx_journal();
+    tx_journal();
+    tx_journal(const tx_journal&) = delete;
+    tx_journal& operator=(const tx_journal&) = delete;
+
+    /**
+     * Opens or creates the journal at `path`, passing each intact record
+     * already in it to `replay`, in order. Anything after the last good
+     * record is cut off, so new records land right after it.
+     */
+    typedef std::function<void (const uint8_t* data, size_t size)> record_fn;
+    bool open(const std::string& path, const record_fn& replay);
+    void close();
+
+    bool is_open() const
+    {
+        return 0 <= fd_;
+    }
+
+    /**
+     * The current length of the journal file, in bytes.
+     */
+    size_t size() const
+    {
+        return size_;
+    }
+
+    /**
+     * True if an append has failed since the journal was opened or
+     * last compacted. The failed record is cut back off, and appends
+     * are refused from then on, so the journal always holds an
+     * unbroken run of changes, though not the latest ones.
+     */
+    bool failed() const
+    {
+        return failed_;
+    }
+
+    /**
+     * Writes a record to the end of the journal and flushes it to disk.
+     */
+    bool append(const bc::data_chunk& record);
+
+    /**
+     * Writes several records with a single write and a single flush.
+     */
+    bool append(const std::vector<bc::data_chunk>& records);
+
+    /**
+     * Drops the first `offset` bytes of the journal, which must fall on
+     * a record boundary. The rest is copied to a new file, which then
+     * replaces the old one. If `caught_up`, the snapshot taken at the
+     * offset holds every change made since, so a failed append has
+     * nothing left missing and appends may resume.
+     */
+    bool discard_before(size_t offset, bool caught_up);
+
+    /**
+     * Flushes a file that was written by some other means to disk.
+     */
+    static bool sync_file(const std::string& path);
+
+    /**
+     * Flushes the directory holding `path`, so that a file renamed into
+     * place there stays renamed after a crash.
+     */
+    static bool sync_dir(const std::string& path);
+
+private:
+    bool write_all(int fd, const uint8_t* data, size_t size);
+
+    std::string path_;
+    int fd_;
+    size_t size_;
+    bool failed_;
+};
+
+} // namespace libwallet
+
+#endif
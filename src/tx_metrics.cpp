@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tx_metrics.hpp"
+
+namespace libwallet {
+
+constexpr size_t latency_recorder::bucket_count;
+
+static const char* call_names[] =
+{
+    "snapshot",
+    "last_height",
+    "has_tx",
+    "get_tx",
+    "with_tx",
+    "get_output",
+    "get_tx_height",
+    "is_spend",
+    "has_history",
+    "get_address_txs",
+    "get_history",
+    "get_spender",
+    "get_conflicts",
+    "get_utxos",
+    "get_balance",
+    "serialize",
+    "load",
+    "load_file",
+    "dump",
+    "export_rows",
+    "open_journal",
+    "compact",
+    "insert",
+    "insert_many",
+    "expire",
+    "at_height",
+    "add_header",
+    "confirmed",
+    "unconfirmed",
+    "forget",
+    "reset_timestamp",
+    "foreach_unconfirmed",
+    "foreach_forked",
+    "foreach_unsent"
+};
+static_assert(sizeof(call_names) / sizeof(call_names[0]) ==
+    static_cast<size_t>(metric_call::count), "a metric_call has no name");
+
+latency_recorder::latency_recorder()
+  : count_(0), total_us_(0), max_us_(0)
+{
+    for (auto& bucket: buckets_)
+        bucket.store(0);
+}
+
+void latency_recorder::record(std::chrono::steady_clock::duration elapsed)
+{
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+        elapsed).count();
+
+    // Bucket `i` holds durations under 2^i us:
+    size_t i = 0;
+    while (i + 1 < bucket_count && (uint64_t(1) << i) <= us)
+        ++i;
+
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_us_.fetch_add(us, std::memory_order_relaxed);
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    auto max = max_us_.load(std::memory_order_relaxed);
+    while (max < us && !max_us_.compare_exchange_weak(max, us,
+        std::memory_order_relaxed))
+        ;
+}
+
+/**
+ * Copies out the histogram. Calls recorded meanwhile may show up in
+ * some fields and not yet in others.
+ */
+latency_histogram latency_recorder::read() const
+{
+    latency_histogram out;
+    out.count = count_.load(std::memory_order_relaxed);
+    out.total_us = total_us_.load(std::memory_order_relaxed);
+    out.max_us = max_us_.load(std::memory_order_relaxed);
+    for (auto& bucket: buckets_)
+        out.buckets.push_back(bucket.load(std::memory_order_relaxed));
+    return out;
+}
+
+tx_metrics::tx_metrics()
+  : enabled_(false)
+{
+}
+
+void tx_metrics::read(tx_db_stats& out) const
+{
+    out.enabled = enabled();
+    out.shared_wait = shared_wait.read();
+    out.shared_hold = shared_hold.read();
+    out.unique_wait = unique_wait.read();
+    out.unique_hold = unique_hold.read();
+
+    // Methods nobody has called are left out:
+    for (size_t i = 0; i < static_cast<size_t>(metric_call::count); ++i)
+    {
+        auto histogram = calls_[i].read();
+        if (histogram.count)
+            out.calls[call_names[i]] = histogram;
+    }
+}
+
+} // namespace libwallet
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_TX_METRICS_HPP
+#define LIBBITCOIN_WATCHER_TX_METRICS_HPP
+
+#include <bitcoin/watcher/tx_db.hpp>
+#include <atomic>
+#include <chrono>
+
+namespace libwallet {
+
+/**
+ * The tx_db methods that metrics time, one histogram each.
+ */
+enum class metric_call
+{
+    snapshot,
+    last_height,
+    has_tx,
+    get_tx,
+    with_tx,
+    get_output,
+    get_tx_height,
+    is_spend,
+    has_history,
+    get_address_txs,
+    get_history,
+    get_spender,
+    get_conflicts,
+    get_utxos,
+    get_balance,
+    serialize,
+    load,
+    load_file,
+    dump,
+    export_rows,
+    open_journal,
+    compact,
+    insert,
+    insert_many,
+    expire,
+    at_height,
+    add_header,
+    confirmed,
+    unconfirmed,
+    forget,
+    reset_timestamp,
+    foreach_unconfirmed,
+    foreach_forked,
+    foreach_unsent,
+    count
+};
+
+/**
+ * Collects a latency histogram. Any number of threads can record at
+ * once, since every field is atomic.
+ */
+class latency_recorder
+{
+public:
+    latency_recorder();
+    latency_recorder(const latency_recorder&) = delete;
+    void operator=(const latency_recorder&) = delete;
+
+    void record(std::chrono::steady_clock::duration elapsed);
+    latency_histogram read() const;
+
+private:
+    // The last bucket takes everything from 2^22us, about 4s, up:
+    static constexpr size_t bucket_count = 24;
+
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> total_us_;
+    std::atomic<uint64_t> max_us_;
+    std::atomic<uint64_t> buckets_[bucket_count];
+};
+
+/**
+ * The timings behind tx_db::stats. Recording is skipped entirely
+ * unless the metrics are enabled, so they cost a flag check when off.
+ */
+class tx_metrics
+{
+public:
+    tx_metrics();
+
+    bool enabled() const
+    {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+    void enable(bool enable)
+    {
+        enabled_.store(enable, std::memory_order_relaxed);
+    }
+
+    latency_recorder& call(metric_call which)
+    {
+        return calls_[static_cast<size_t>(which)];
+    }
+
+    /**
+     * Fills in the timing parts of `out`.
+     */
+    void read(tx_db_stats& out) const;
+
+    latency_recorder shared_wait;
+    latency_recorder shared_hold;
+    latency_recorder unique_wait;
+    latency_recorder unique_hold;
+
+private:
+    std::atomic<bool> enabled_;
+    latency_recorder calls_[static_cast<size_t>(metric_call::count)];
+};
+
+/**
+ * Times a method call from construction to destruction, if metrics
+ * were on when it started.
+ */
+class timed_call
+{
+public:
+    timed_call(tx_metrics& metrics, metric_call which)
+      : recorder_(nullptr)
+    {
+        if (!metrics.enabled())
+            return;
+        recorder_ = &metrics.call(which);
+        start_ = std::chrono::steady_clock::now();
+    }
+    ~timed_call()
+    {
+        if (recorder_)
+            recorder_->record(std::chrono::steady_clock::now() - start_);
+    }
+    timed_call(const timed_call&) = delete;
+    void operator=(const timed_call&) = delete;
+
+private:
+    latency_recorder* recorder_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * Holds a lock of type `Lock`, timing the wait for it and how long it
+ * is held, if metrics were on when it was taken.
+ */
+template <typename Lock>
+class timed_lock
+{
+public:
+    template <typename Mutex>
+    timed_lock(Mutex& mutex, tx_metrics& metrics, latency_recorder& wait,
+        latency_recorder& hold)
+      : hold_(nullptr)
+    {
+        if (!metrics.enabled())
+        {
+            lock_ = Lock(mutex);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        lock_ = Lock(mutex);
+        start_ = std::chrono::steady_clock::now();
+        wait.record(start_ - start);
+        hold_ = &hold;
+    }
+    ~timed_lock()
+    {
+        if (!hold_)
+            return;
+        lock_.unlock();
+        hold_->record(std::chrono::steady_clock::now() - start_);
+    }
+
+    /**
+     * Lets the lock go before the end of the scope.
+     */
+    void unlock()
+    {
+        lock_.unlock();
+        if (!hold_)
+            return;
+        hold_->record(std::chrono::steady_clock::now() - start_);
+        hold_ = nullptr;
+    }
+    timed_lock(const timed_lock&) = delete;
+    void operator=(const timed_lock&) = delete;
+
+private:
+    Lock lock_;
+    latency_recorder* hold_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace libwallet
+
+#endif
@@ -0,0 +1,1844 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tx_table.hpp"
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <zlib.h>
+#include "parallel.hpp"
+
+namespace libwallet {
+
+// Serialization stuff:
+constexpr uint32_t old_serial_magic = 0x3eab61c3; // From the watcher
+constexpr uint32_t serial_magic = 0xfecdb760;
+constexpr uint8_t serial_tx = 0x42;
+
+// The compact format:
+constexpr uint32_t compact_serial_magic = 0xfecdb761;
+constexpr uint8_t serial_compressed = 1 << 0;
+constexpr uint8_t serial_headers = 1 << 1;
+constexpr uint8_t row_state_mask = 0x03;
+constexpr uint8_t row_need_check = 1 << 2;
+constexpr uint8_t row_block_hash = 1 << 3;
+
+// The number of recent block headers kept for spotting reorgs:
+constexpr size_t header_depth = 144;
+
+// zlib cannot do better than this, so larger claims are bogus:
+constexpr uint64_t max_deflate_ratio = 1032;
+
+// Exports are written out in chunks of about this size:
+constexpr size_t export_buffer_size = 64 * 1024;
+
+// Streamed saves hand rows on in chunks of about this many bytes:
+constexpr size_t save_buffer_size = 64 * 1024;
+
+// Rows are decoded this many at a time, and then merged into the
+// table, so lazy loads never hold many decoded transactions at once:
+constexpr size_t parse_batch = 16 * 1024;
+
+// Batches smaller than this are decoded on the calling thread alone:
+constexpr size_t min_parse_slice = 256;
+
+/**
+ * Heights, timestamps and sizes are mostly small, so the compact format
+ * stores them seven bits at a time, low bits first, with the top bit
+ * of each byte marking that more follow. Each number has exactly one
+ * valid encoding, the shortest.
+ */
+static size_t varint_size(uint64_t value)
+{
+    size_t size = 1;
+    for (; 0x80 <= value; value >>= 7)
+        ++size;
+    return size;
+}
+
+template <typename Serializer>
+static void write_varint(Serializer& serial, uint64_t value)
+{
+    for (; 0x80 <= value; value >>= 7)
+        serial.write_byte(0x80 | (value & 0x7f));
+    serial.write_byte(value);
+}
+
+/**
+ * Reads a varint, treating padded or oversized encodings like a
+ * truncated file, so they fail the load.
+ */
+template <typename Deserializer>
+static uint64_t read_varint(Deserializer& serial)
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t byte = serial.read_byte();
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            // A zero final byte only pads out a shorter encoding, and
+            // the tenth byte only has room for one more bit:
+            if ((shift && !byte) || (63 == shift && 1 < byte))
+                throw bc::end_of_stream();
+            return value;
+        }
+    }
+    throw bc::end_of_stream();
+}
+
+/**
+ * Steps over `size` bytes of a raw transaction, failing if they are
+ * not all there.
+ */
+template <typename Deserializer>
+static void skip_bytes(Deserializer& serial, const uint8_t* end,
+    uint64_t size)
+{
+    if (static_cast<uint64_t>(end - serial.iterator()) < size)
+        throw bc::end_of_stream();
+    serial.set_iterator(serial.iterator() + size);
+}
+
+/**
+ * Steps over a raw transaction's version and inputs by their length
+ * prefixes, without decoding them. Returns the number of outputs that
+ * follow.
+ */
+template <typename Deserializer>
+static uint64_t skip_inputs(Deserializer& serial, const uint8_t* end)
+{
+    // Version, then each input's previous output, script and sequence:
+    skip_bytes(serial, end, 4);
+    auto inputs = serial.read_variable_uint();
+    for (uint64_t i = 0; i < inputs; ++i)
+    {
+        skip_bytes(serial, end, 36);
+        skip_bytes(serial, end, serial.read_variable_uint());
+        skip_bytes(serial, end, 4);
+    }
+    return serial.read_variable_uint();
+}
+
+template <typename Deserializer>
+static void skip_output(Deserializer& serial, const uint8_t* end)
+{
+    skip_bytes(serial, end, 8);
+    skip_bytes(serial, end, serial.read_variable_uint());
+}
+
+/**
+ * The size of the raw transaction at `data`, found without decoding it.
+ */
+static size_t raw_tx_size(const uint8_t* data, const uint8_t* end)
+{
+    auto serial = bc::make_deserializer(data, end);
+    auto outputs = skip_inputs(serial, end);
+    for (uint64_t i = 0; i < outputs; ++i)
+        skip_output(serial, end);
+    skip_bytes(serial, end, 4);
+    return serial.iterator() - data;
+}
+
+/**
+ * True for the previous output of a coinbase input, which spends
+ * nothing. Every coinbase shares it, so it must not look contested.
+ */
+static bool is_null_point(const bc::output_point& point)
+{
+    return point.hash == bc::null_hash && point.index == 0xffffffff;
+}
+
+/**
+ * Runs data through zlib a piece at a time, handing the compressed
+ * output to a sink as it comes.
+ */
+class deflater
+{
+public:
+    typedef std::function<void (const uint8_t* data, size_t size)> sink_fn;
+
+    deflater(const sink_fn& sink)
+      : sink_(sink)
+    {
+        stream_.zalloc = Z_NULL;
+        stream_.zfree = Z_NULL;
+        stream_.opaque = Z_NULL;
+        auto status = deflateInit(&stream_, Z_DEFAULT_COMPRESSION);
+        BITCOIN_ASSERT(Z_OK == status);
+        (void)status;
+    }
+    ~deflater()
+    {
+        deflateEnd(&stream_);
+    }
+
+    void write(const uint8_t* data, size_t size)
+    {
+        run(data, size, Z_NO_FLUSH);
+    }
+    void finish()
+    {
+        run(nullptr, 0, Z_FINISH);
+    }
+
+private:
+    void run(const uint8_t* data, size_t size, int flush)
+    {
+        stream_.next_in = const_cast<uint8_t*>(data);
+        stream_.avail_in = size;
+        do
+        {
+            stream_.next_out = buffer_;
+            stream_.avail_out = sizeof(buffer_);
+            deflate(&stream_, flush);
+            sink_(buffer_, sizeof(buffer_) - stream_.avail_out);
+        } while (!stream_.avail_out);
+    }
+
+    const sink_fn& sink_;
+    z_stream stream_;
+    uint8_t buffer_[16384];
+};
+
+tx_table::tx_table()
+  : last_height_(0)
+{
+}
+
+size_t tx_table::last_height() const
+{
+    return last_height_;
+}
+
+bool tx_table::has_tx(bc::hash_digest tx_hash) const
+{
+    return rows_.find(tx_hash) != rows_.end();
+}
+
+bc::transaction_type tx_table::get_tx(bc::hash_digest tx_hash) const
+{
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return bc::transaction_type();
+    return *i->second.decode();
+}
+
+/**
+ * Returns the row's transaction without copying it, or null if there
+ * is no such row. Lazy rows decode a copy that only the caller holds.
+ */
+std::shared_ptr<const bc::transaction_type> tx_table::find_tx(
+    bc::hash_digest tx_hash) const
+{
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return nullptr;
+    return i->second.decode();
+}
+
+bool tx_table::get_output(const bc::output_point& point,
+    bc::transaction_output_type& out) const
+{
+    auto i = rows_.find(point.hash);
+    if (i == rows_.end())
+        return false;
+    return i->second.decode_output(point.index, out);
+}
+
+size_t tx_table::get_tx_height(bc::hash_digest tx_hash) const
+{
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return 0;
+    if (i->second.state != tx_state::confirmed)
+        return 0;
+    return i->second.block_height;
+}
+
+bool tx_table::is_spend(bc::hash_digest tx_hash,
+    const address_set& addresses) const
+{
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return false;
+
+    for (auto& input: i->second.input_addresses)
+    {
+        if (!input.valid)
+            return false;
+        if (addresses.find(input.address) == addresses.end())
+            return false;
+    }
+    return true;
+}
+
+bool tx_table::has_history(const bc::payment_address& address) const
+{
+    auto i = addresses_.find(address);
+    if (i == addresses_.end())
+        return false;
+    for (auto& use: i->second)
+        if (!use.input)
+            return true;
+
+    return false;
+}
+
+std::vector<bc::hash_digest> tx_table::get_address_txs(
+    const bc::payment_address& address) const
+{
+    std::vector<bc::hash_digest> out;
+    auto i = addresses_.find(address);
+    if (i == addresses_.end())
+        return out;
+
+    // A transaction can touch the same address more than once:
+    std::unordered_set<bc::hash_digest> seen;
+    for (auto& use: i->second)
+        if (seen.insert(use.tx_hash).second)
+            out.push_back(use.tx_hash);
+    return out;
+}
+
+history_list tx_table::get_history(const bc::payment_address& address,
+    size_t from_height, size_t limit, bc::hash_digest cursor) const
+{
+    history_list out;
+    auto i = history_.find(address);
+    if (i == history_.end())
+        return out;
+
+    // Resume just past the cursor, or else at the start of the height:
+    auto start = std::make_pair(from_height, cursor);
+    auto j = i->second.lower_bound(start);
+    if (j != i->second.end() && cursor != bc::null_hash && *j == start)
+        ++j;
+
+    for (; j != i->second.end() && out.size() < limit; ++j)
+    {
+        auto& row = rows_.find(j->second)->second;
+        out.push_back(history_row{j->second, row.state, j->first});
+    }
+    return out;
+}
+
+bc::hash_digest tx_table::get_spender(const bc::output_point& point) const
+{
+    auto i = spends_.find(point);
+    if (i == spends_.end())
+        return bc::null_hash;
+    return i->second;
+}
+
+std::vector<bc::hash_digest> tx_table::get_conflicts(
+    bc::hash_digest tx_hash) const
+{
+    std::vector<bc::hash_digest> out;
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return out;
+
+    // Only contested outputs appear among the conflicts:
+    auto tx = i->second.decode();
+    for (auto& input: tx->inputs)
+    {
+        auto j = conflicts_.find(input.previous_output);
+        if (j == conflicts_.end())
+            continue;
+        out.push_back(spends_.find(input.previous_output)->second);
+        out.insert(out.end(), j->second.begin(), j->second.end());
+    }
+
+    // Leave out the transaction itself, and any repeats:
+    out.erase(std::remove(out.begin(), out.end(), tx_hash), out.end());
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+bc::output_info_list tx_table::get_utxos() const
+{
+    bc::output_info_list out;
+    out.reserve(utxos_.size());
+    for (auto& utxo: utxos_)
+    {
+        bc::output_info_type info = {utxo.first, utxo.second};
+        out.push_back(info);
+    }
+    return out;
+}
+
+bc::output_info_list tx_table::get_utxos(
+    const address_set& addresses) const
+{
+    // Check each output paying to these addresses:
+    bc::output_info_list utxos;
+    for (auto& address: addresses)
+    {
+        auto i = addresses_.find(address);
+        if (i == addresses_.end())
+            continue;
+
+        for (auto& use: i->second)
+        {
+            if (use.input)
+                continue;
+            bc::output_point point = {use.tx_hash, use.index};
+            auto j = utxos_.find(point);
+            if (j != utxos_.end())
+            {
+                bc::output_info_type info = {point, j->second};
+                utxos.push_back(info);
+            }
+        }
+    }
+
+    return utxos;
+}
+
+address_balance tx_table::get_balance(const address_set& addresses) const
+{
+    address_balance out = {0, 0};
+    for (auto& address: addresses)
+    {
+        auto i = balances_.find(address);
+        if (i == balances_.end())
+            continue;
+        out.confirmed += i->second.confirmed;
+        out.unconfirmed += i->second.unconfirmed;
+    }
+    return out;
+}
+
+bc::data_chunk tx_table::serialize(unsigned flags) const
+{
+    // Size the blob up front, so it can be written in one pass:
+    bc::data_chunk out(header_size() + payload_size());
+    auto end = write_header(out.data());
+    for (const auto& row: rows_)
+        end = write_row(end, row.second);
+    BITCOIN_ASSERT(end == out.data() + out.size());
+
+    if (flags & compress_rows)
+        return compress(out);
+    return out;
+}
+
+void tx_table::serialize(std::ostream& out, unsigned flags) const
+{
+    sink_fn put = [&out](const uint8_t* data, size_t size)
+    {
+        out.write(reinterpret_cast<const char*>(data), size);
+    };
+
+    // The header is small, so it is built whole:
+    bc::data_chunk header(header_size());
+    write_header(header.data());
+    if (!(flags & compress_rows))
+    {
+        put(header.data(), header.size());
+        write_rows(put);
+        out.flush();
+        return;
+    }
+
+    // Compressed rows follow their inflated size, as in `compress`:
+    header[4] |= serial_compressed;
+    uint8_t length[10];
+    auto prefix = bc::make_serializer(length);
+    write_varint(prefix, payload_size());
+    header.insert(header.end(), length, prefix.iterator());
+    put(header.data(), header.size());
+
+    deflater zip(put);
+    sink_fn deflate = [&zip](const uint8_t* data, size_t size)
+    {
+        zip.write(data, size);
+    };
+    write_rows(deflate);
+    zip.finish();
+    out.flush();
+}
+
+bc::data_chunk tx_table::compress(const bc::data_chunk& blob)
+{
+    // Step over the header, which carries over with just the flag and
+    // the inflated size added:
+    auto begin = blob.data();
+    auto serial = bc::make_deserializer(begin, begin + blob.size());
+    serial.read_4_bytes();
+    auto format = serial.read_byte();
+    BITCOIN_ASSERT(!(format & serial_compressed));
+    read_varint(serial);
+    if (format & serial_headers)
+    {
+        auto count = read_varint(serial);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            read_varint(serial);
+            serial.read_hash();
+        }
+    }
+    auto rows = serial.iterator();
+    size_t payload = begin + blob.size() - rows;
+
+    bc::data_chunk out(begin, rows);
+    out[4] = format | serial_compressed;
+    uint8_t length[10];
+    auto prefix = bc::make_serializer(length);
+    write_varint(prefix, payload);
+    out.insert(out.end(), length, prefix.iterator());
+
+    // The compressed size is not known until the end:
+    deflater::sink_fn sink = [&out](const uint8_t* data, size_t size)
+    {
+        out.insert(out.end(), data, data + size);
+    };
+    deflater zip(sink);
+    zip.write(rows, payload);
+    zip.finish();
+    return out;
+}
+
+bool tx_table::load(const uint8_t* data, size_t size,
+    std::shared_ptr<const void> backing, unsigned flags)
+{
+    const uint8_t* end = data + size;
+    auto serial = bc::make_deserializer(data, end);
+
+    try
+    {
+        // Header bytes. The old watcher format has nothing we can use,
+        // so it leaves the table empty:
+        auto magic = serial.read_4_bytes();
+        if (old_serial_magic == magic)
+            return true;
+
+        if (serial_magic == magic)
+            return load_v1(serial.iterator(), end, std::move(backing),
+                flags);
+        if (compact_serial_magic == magic)
+            return load_v2(serial.iterator(), end, std::move(backing),
+                flags);
+        return false;
+    }
+    catch (bc::end_of_stream)
+    {
+        return false;
+    }
+}
+
+void tx_table::dump(std::ostream& out) const
+{
+    std::string buffer;
+    buffer.reserve(export_buffer_size + 4096);
+    buffer += "height: " + std::to_string(last_height_) + '\n';
+    for (const auto& row: rows_)
+    {
+        dump_row(buffer, row.first, row.second);
+        if (export_buffer_size <= buffer.size())
+        {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+}
+
+void tx_table::get_sizes(tx_db_stats& out) const
+{
+    out.rows = rows_.size();
+    out.unsent = unsent_.size();
+    out.unconfirmed = unconfirmed_.size();
+    out.confirmed = out.rows - out.unsent - out.unconfirmed;
+    out.forked = forked_.size();
+    out.utxos = utxos_.size();
+}
+
+void tx_table::export_rows(std::ostream& out, export_format format,
+    const export_filter& filter) const
+{
+    // Records collect in a buffer, which goes out in large writes:
+    std::string buffer;
+    buffer.reserve(export_buffer_size + 4096);
+    for (const auto& row: rows_)
+    {
+        if (!exported(row.second, filter))
+            continue;
+
+        export_row(buffer, row.first, row.second, format);
+        if (export_buffer_size <= buffer.size())
+        {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+}
+
+std::vector<bc::hash_digest> tx_table::row_hashes() const
+{
+    std::vector<bc::hash_digest> out;
+    out.reserve(rows_.size());
+    for (const auto& row: rows_)
+        out.push_back(row.first);
+    return out;
+}
+
+size_t tx_table::dump_chunk(std::string& out,
+    const std::vector<bc::hash_digest>& hashes, size_t next) const
+{
+    if (!next)
+        out += "height: " + std::to_string(last_height_) + '\n';
+    for (; next < hashes.size() && out.size() < export_buffer_size; ++next)
+    {
+        auto i = rows_.find(hashes[next]);
+        if (i != rows_.end())
+            dump_row(out, i->first, i->second);
+    }
+    return next;
+}
+
+size_t tx_table::export_chunk(std::string& out,
+    const std::vector<bc::hash_digest>& hashes, size_t next,
+    export_format format, const export_filter& filter) const
+{
+    for (; next < hashes.size() && out.size() < export_buffer_size; ++next)
+    {
+        auto i = rows_.find(hashes[next]);
+        if (i != rows_.end() && exported(i->second, filter))
+            export_row(out, i->first, i->second, format);
+    }
+    return next;
+}
+
+void tx_table::reserve(size_t count, size_t inputs, size_t outputs)
+{
+    rows_.reserve(rows_.size() + count);
+    spends_.reserve(spends_.size() + inputs);
+    utxos_.reserve(utxos_.size() + outputs);
+}
+
+bool tx_table::insert(const bc::transaction_type& tx, tx_state state)
+{
+    return insert(tx, bc::hash_transaction(tx), state);
+}
+
+/**
+ * Inserts a transaction whose hash the caller has already worked out.
+ */
+bool tx_table::insert(const bc::transaction_type& tx,
+    bc::hash_digest tx_hash, tx_state state)
+{
+    // Do not stomp existing tx's:
+    if (rows_.find(tx_hash) == rows_.end()) {
+        auto& row = rows_[tx_hash];
+        row.tx = std::make_shared<bc::transaction_type>(tx);
+        row.raw = nullptr;
+        row.raw_size = 0;
+        row.state = state;
+        row.block_height = 0;
+        row.timestamp = time(nullptr);
+        row.block_hash = bc::null_hash;
+        row.need_check = false;
+        row.extract_addresses(tx, row_allocator());
+        index_tx(tx_hash, row, tx);
+        index_state(tx_hash, row);
+        return true;
+    }
+    return false;
+}
+
+bool tx_table::at_height(size_t height)
+{
+    // Forks are caught by comparing block headers, in add_header. If
+    // the last block's header never arrived, or the new height is so far
+    // past it that the walk down cannot reach it, that cannot work, so
+    // fall back to checking the block below:
+    bool changed = last_height_ != height;
+    if (changed && (header_hash(last_height_) == bc::null_hash ||
+        last_height_ + header_depth <= height))
+        check_fork(height);
+    last_height_ = height;
+    return changed;
+}
+
+bool tx_table::would_confirm(bc::hash_digest tx_hash,
+    size_t block_height) const
+{
+    auto i = rows_.find(tx_hash);
+    return i != rows_.end() && confirm_changes(i->second, block_height);
+}
+
+bool tx_table::would_unconfirm(bc::hash_digest tx_hash) const
+{
+    auto i = rows_.find(tx_hash);
+    return i != rows_.end() && unconfirm_changes(i->second);
+}
+
+bool tx_table::would_reset_timestamp(bc::hash_digest tx_hash) const
+{
+    // Only the rows waiting to expire have a timestamp that matters:
+    auto i = rows_.find(tx_hash);
+    return i != rows_.end() && tx_state::confirmed != i->second.state &&
+        i->second.timestamp != time(nullptr);
+}
+
+bool tx_table::confirmed(bc::hash_digest tx_hash, size_t block_height)
+{
+    // Replies to queries can arrive after expiry forgot the row:
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return false;
+    auto& row = i->second;
+
+    // If the transaction was already confirmed in another block,
+    // that means the chain has forked:
+    if (row.state == tx_state::confirmed && row.block_height != block_height)
+    {
+        //on_fork_();
+        check_fork(row.block_height);
+    }
+
+    bool changed = confirm_changes(row, block_height);
+    set_state(tx_hash, row, tx_state::confirmed, block_height);
+    return changed;
+}
+
+bool tx_table::unconfirmed(bc::hash_digest tx_hash)
+{
+    // Replies to queries can arrive after expiry forgot the row:
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return false;
+    auto& row = i->second;
+
+    // If the transaction was already confirmed, and is now unconfirmed,
+    // we probably have a block fork:
+    if (row.state == tx_state::confirmed)
+    {
+        //on_fork_();
+        check_fork(row.block_height);
+    }
+
+    bool changed = unconfirm_changes(row);
+    set_state(tx_hash, row, tx_state::unconfirmed, row.block_height);
+    return changed;
+}
+
+bool tx_table::forget(bc::hash_digest tx_hash)
+{
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return false;
+    unindex_tx(tx_hash, i->second);
+    unindex_state(tx_hash, i->second);
+    rows_.erase(i);
+    return true;
+}
+
+void tx_table::reset_timestamp(bc::hash_digest tx_hash)
+{
+    auto i = rows_.find(tx_hash);
+    if (i == rows_.end())
+        return;
+
+    // Move the row to the back of the expiry queue, if it is in it:
+    auto& row = i->second;
+    auto entry = std::make_pair(row.timestamp, tx_hash);
+    bool queued = expiry_.erase(entry);
+    row.timestamp = time(nullptr);
+    if (queued)
+        expiry_.insert(std::make_pair(row.timestamp, tx_hash));
+}
+
+bool tx_table::has_expired(time_t now, unsigned timeout) const
+{
+    return !expiry_.empty() && expiry_.begin()->first + timeout < now;
+}
+
+std::vector<bc::hash_digest> tx_table::expire(time_t now, unsigned timeout)
+{
+    // The queue is ordered by timestamp, so the due rows are up front:
+    std::vector<bc::hash_digest> out;
+    while (has_expired(now, timeout))
+    {
+        auto tx_hash = expiry_.begin()->second;
+        out.push_back(tx_hash);
+        forget(tx_hash);
+    }
+    return out;
+}
+
+bool tx_table::add_header(size_t height, bc::hash_digest block_hash,
+    bc::hash_digest previous)
+{
+    set_header(height, block_hash);
+    if (!height)
+        return false;
+
+    auto old = header_hash(height - 1);
+    set_header(height - 1, previous);
+    if (old == previous)
+        return false;
+
+    // The parent either replaced a block or filled a gap, as when the
+    // tip jumps ahead by several blocks. Either way, keep walking down
+    // while there are older headers left to meet:
+    return headers_.begin()->first < height - 1;
+}
+
+void tx_table::foreach_unconfirmed(const hash_fn& f) const
+{
+    for (auto& tx_hash: unsent_)
+        f(tx_hash);
+    for (auto& tx_hash: unconfirmed_)
+        f(tx_hash);
+}
+
+void tx_table::foreach_forked(const hash_fn& f) const
+{
+    for (auto& tx_hash: forked_)
+        f(tx_hash);
+}
+
+void tx_table::foreach_unsent(const tx_fn& f) const
+{
+    for (auto& tx_hash: unsent_)
+    {
+        auto i = rows_.find(tx_hash);
+        BITCOIN_ASSERT(i != rows_.end());
+        f(*i->second.decode());
+    }
+}
+
+/**
+ * The number saved with a row. Unconfirmed rows save their timestamp
+ * in place of a block height.
+ */
+uint64_t tx_table::saved_height(const tx_row& row)
+{
+    if (tx_state::unconfirmed == row.state)
+        return row.timestamp;
+    return row.block_height;
+}
+
+/**
+ * The serialized size of a row.
+ */
+size_t tx_table::row_size(const tx_row& row)
+{
+    // Flags, height, block hash if known, tx size, tx:
+    auto size = row.tx_size();
+    size_t hash_size = 0;
+    if (row.block_hash != bc::null_hash)
+        hash_size = 32;
+    return 1 + varint_size(saved_height(row)) + hash_size +
+        varint_size(size) + size;
+}
+
+/**
+ * The total size of the rows.
+ */
+size_t tx_table::payload_size() const
+{
+    size_t size = 0;
+    for (const auto& row: rows_)
+        size += row_size(row.second);
+    return size;
+}
+
+size_t tx_table::header_size() const
+{
+    // Magic, flags, height, and recent headers if any:
+    size_t size = 4 + 1 + varint_size(last_height_);
+    if (!headers_.empty())
+    {
+        size += varint_size(headers_.size());
+        for (const auto& header: headers_)
+            size += varint_size(header.first) + 32;
+    }
+    return size;
+}
+
+uint8_t* tx_table::write_header(uint8_t* out) const
+{
+    auto serial = bc::make_serializer(out);
+
+    // Magic version bytes:
+    uint8_t flags = 0;
+    if (!headers_.empty())
+        flags |= serial_headers;
+    serial.write_4_bytes(compact_serial_magic);
+    serial.write_byte(flags);
+
+    // Last block height:
+    write_varint(serial, last_height_);
+
+    // Recent block headers:
+    if (!headers_.empty())
+    {
+        write_varint(serial, headers_.size());
+        for (const auto& header: headers_)
+        {
+            write_varint(serial, header.first);
+            serial.write_hash(header.second);
+        }
+    }
+    return serial.iterator();
+}
+
+/**
+ * Writes a row to `out`, which must have room for `row_size` bytes.
+ * Returns the position just past the row.
+ */
+uint8_t* tx_table::write_row(uint8_t* out, const tx_row& row)
+{
+    uint8_t flags = static_cast<uint8_t>(row.state);
+    if (row.need_check)
+        flags |= row_need_check;
+    if (row.block_hash != bc::null_hash)
+        flags |= row_block_hash;
+
+    // The hash is left out, since loading works it out again anyhow:
+    auto serial = bc::make_serializer(out);
+    serial.write_byte(flags);
+    write_varint(serial, saved_height(row));
+    if (row.block_hash != bc::null_hash)
+        serial.write_hash(row.block_hash);
+    write_varint(serial, row.tx_size());
+    if (row.tx)
+        serial.set_iterator(satoshi_save(*row.tx, serial.iterator()));
+    else
+        serial.set_iterator(std::copy(row.raw, row.raw + row.raw_size,
+            serial.iterator()));
+    return serial.iterator();
+}
+
+/**
+ * Hands every row to `sink`, gathered into chunks of about
+ * `save_buffer_size` bytes.
+ */
+void tx_table::write_rows(const sink_fn& sink) const
+{
+    bc::data_chunk buffer;
+    buffer.reserve(save_buffer_size + 4096);
+    for (const auto& row: rows_)
+    {
+        auto start = buffer.size();
+        buffer.resize(start + row_size(row.second));
+        write_row(buffer.data() + start, row.second);
+        if (save_buffer_size <= buffer.size())
+        {
+            sink(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    if (!buffer.empty())
+        sink(buffer.data(), buffer.size());
+}
+
+/**
+ * Appends a row to `out` as the lines of a debug dump.
+ */
+void tx_table::dump_row(std::string& out, bc::hash_digest tx_hash,
+    const tx_row& row)
+{
+    std::ostringstream text;
+    text << "================" << '\n';
+    text << "hash: " << bc::encode_hex(tx_hash) << '\n';
+    switch (row.state)
+    {
+    case tx_state::unsent:
+        text << "state: unsent" << '\n';
+        break;
+    case tx_state::unconfirmed:
+        text << "state: unconfirmed" << '\n';
+        text << "timestamp: " << row.timestamp << '\n';
+        break;
+    case tx_state::confirmed:
+        text << "state: confirmed" << '\n';
+        text << "height: " << row.block_height << '\n';
+        if (row.block_hash != bc::null_hash)
+            text << "block: " << bc::encode_hex(row.block_hash) << '\n';
+        if (row.need_check)
+            text << "needs check." << '\n';
+        break;
+    }
+    for (auto& input: row.input_addresses)
+    {
+        if (input.valid)
+            text << "input: " << input.address.encoded() << '\n';
+    }
+    auto tx = row.decode();
+    const auto& outputs = tx->outputs;
+    for (size_t i = 0; i < outputs.size(); ++i)
+    {
+        auto& output = row.output_addresses[i];
+        if (output.valid)
+            text << "output: " << output.address.encoded() << " " <<
+                outputs[i].value << '\n';
+    }
+    out += text.str();
+}
+
+/**
+ * Appends a row to `out` as an export record in the given format.
+ */
+void tx_table::export_row(std::string& out, bc::hash_digest tx_hash,
+    const tx_row& row, export_format format)
+{
+    if (export_format::binary != format)
+    {
+        write_json(out, tx_hash, row);
+        return;
+    }
+    auto start = out.size();
+    out.resize(start + 32 + row_size(row));
+    auto data = reinterpret_cast<uint8_t*>(&out[start]);
+    data = std::copy(tx_hash.begin(), tx_hash.end(), data);
+    write_row(data, row);
+}
+
+/**
+ * Returns true if confirming a row at `block_height` would change it.
+ */
+bool tx_table::confirm_changes(const tx_row& row, size_t block_height)
+{
+    return row.state != tx_state::confirmed ||
+        row.block_height != block_height || row.need_check;
+}
+
+/**
+ * Returns true if marking a row unconfirmed would change it.
+ */
+bool tx_table::unconfirm_changes(const tx_row& row)
+{
+    return row.state != tx_state::unconfirmed || row.need_check;
+}
+
+/**
+ * Returns true if a row passes an export filter.
+ */
+bool tx_table::exported(const tx_row& row, const export_filter& filter)
+{
+    switch (row.state)
+    {
+    case tx_state::unsent:
+        if (!filter.unsent)
+            return false;
+        break;
+    case tx_state::unconfirmed:
+        if (!filter.unconfirmed)
+            return false;
+        break;
+    case tx_state::confirmed:
+        if (!filter.confirmed)
+            return false;
+        break;
+    }
+    auto height = history_height(row);
+    return filter.min_height <= height && height <= filter.max_height;
+}
+
+/**
+ * Appends a row to `out` as a line of JSON. The addresses come from
+ * the row's cache, so only the output values need the transaction.
+ */
+void tx_table::write_json(std::string& out, bc::hash_digest tx_hash,
+    const tx_row& row)
+{
+    out += "{\"hash\":\"";
+    out += bc::encode_hex(tx_hash);
+    out += "\",\"state\":\"";
+    switch (row.state)
+    {
+    case tx_state::unsent:
+        out += "unsent\"";
+        break;
+    case tx_state::unconfirmed:
+        out += "unconfirmed\",\"timestamp\":";
+        out += std::to_string(row.timestamp);
+        break;
+    case tx_state::confirmed:
+        out += "confirmed\",\"height\":";
+        out += std::to_string(row.block_height);
+        if (row.block_hash != bc::null_hash)
+        {
+            out += ",\"block\":\"";
+            out += bc::encode_hex(row.block_hash);
+            out += "\"";
+        }
+        break;
+    }
+
+    // Scripts without a recognizable address show up as null:
+    auto address = [&out](const script_address& use)
+    {
+        if (!use.valid)
+        {
+            out += "null";
+            return;
+        }
+        out += "\"";
+        out += use.address.encoded();
+        out += "\"";
+    };
+
+    out += ",\"inputs\":[";
+    for (size_t i = 0; i < row.input_addresses.size(); ++i)
+    {
+        if (i)
+            out += ",";
+        address(row.input_addresses[i]);
+    }
+
+    out += "],\"outputs\":[";
+    auto tx = row.decode();
+    for (size_t i = 0; i < tx->outputs.size(); ++i)
+    {
+        if (i)
+            out += ",";
+        out += "{\"address\":";
+        address(row.output_addresses[i]);
+        out += ",\"value\":";
+        out += std::to_string(tx->outputs[i].value);
+        out += "}";
+    }
+    out += "]}\n";
+}
+
+/**
+ * Reads the original format, which spells out each row's hash and
+ * uses fixed-size numbers. The hashes are trusted unless `verify_txids`
+ * is set. Rows carry no size, so finding them means stepping through
+ * each transaction by its length prefixes, though without decoding it.
+ */
+bool tx_table::load_v1(const uint8_t* data, const uint8_t* end,
+    std::shared_ptr<const void> backing, unsigned flags)
+{
+    auto serial = bc::make_deserializer(data, end);
+
+    // Last block height:
+    last_height_ = serial.read_8_bytes();
+
+    std::vector<row_record> records;
+    while (serial.iterator() != end)
+    {
+        if (serial.read_byte() != serial_tx)
+            return false;
+
+        row_record record;
+        record.hash = serial.read_hash();
+        record.raw = serial.iterator();
+        record.raw_size = raw_tx_size(record.raw, end);
+        serial.set_iterator(record.raw + record.raw_size);
+        auto state = serial.read_byte();
+        if (!is_tx_state(state))
+            return false;
+        record.flags = state;
+        record.height = serial.read_8_bytes();
+        record.block_hash = bc::null_hash;
+        if (serial.read_byte())
+            record.flags |= row_need_check;
+        records.push_back(record);
+    }
+
+    return load_rows(records, std::move(backing), flags);
+}
+
+/**
+ * Reads the compact format, which packs the numbers into varints and
+ * leaves out the hashes. Every row is sized up front, so finding them
+ * takes no parsing.
+ */
+bool tx_table::load_v2(const uint8_t* data, const uint8_t* end,
+    std::shared_ptr<const void> backing, unsigned flags)
+{
+    auto serial = bc::make_deserializer(data, end);
+    auto format = serial.read_byte();
+    if (format & ~(serial_compressed | serial_headers))
+        return false;
+
+    // Last block height:
+    last_height_ = read_varint(serial);
+
+    // Recent block headers:
+    if (format & serial_headers)
+    {
+        auto count = read_varint(serial);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            auto height = read_varint(serial);
+            headers_[height] = serial.read_hash();
+        }
+    }
+
+    // Compressed rows are inflated in one go, since the header gives
+    // their size. Lazy rows then point into the inflated copy:
+    const uint8_t* rows_begin = serial.iterator();
+    const uint8_t* rows_end = end;
+    std::shared_ptr<bc::data_chunk> inflated;
+    if (format & serial_compressed)
+    {
+        auto size = read_varint(serial);
+        auto source = serial.iterator();
+        auto source_size = static_cast<uint64_t>(end - source);
+        if (max_deflate_ratio * source_size < size)
+            return false;
+
+        inflated = std::make_shared<bc::data_chunk>(size);
+        uLongf inflated_size = size;
+        if (Z_OK != uncompress(inflated->data(), &inflated_size,
+            source, source_size) || inflated_size != size)
+            return false;
+
+        rows_begin = inflated->data();
+        rows_end = rows_begin + size;
+        if (backing)
+            backing = inflated;
+    }
+
+    // Find where each row lies before decoding any of them:
+    std::vector<row_record> records;
+    auto rows = bc::make_deserializer(rows_begin, rows_end);
+    while (rows.iterator() != rows_end)
+    {
+        row_record record;
+        record.hash = bc::null_hash;
+        record.flags = rows.read_byte();
+        record.height = read_varint(rows);
+        record.block_hash = bc::null_hash;
+        if (record.flags & row_block_hash)
+            record.block_hash = rows.read_hash();
+        record.raw_size = read_varint(rows);
+        record.raw = rows.iterator();
+        auto known = row_state_mask | row_need_check | row_block_hash;
+        if (record.flags & ~known ||
+            static_cast<uint64_t>(rows_end - record.raw) < record.raw_size)
+            return false;
+        rows.set_iterator(record.raw + record.raw_size);
+        records.push_back(record);
+    }
+
+    return load_rows(records, std::move(backing), flags);
+}
+
+/**
+ * Decodes the rows that a load found and adds them to the table. With
+ * `parallel_parse` set, the rows are decoded and hashed on all cores,
+ * and only merging them into the table happens on this thread.
+ */
+bool tx_table::load_rows(const std::vector<row_record>& records,
+    std::shared_ptr<const void> backing, unsigned flags)
+{
+    // The workers start once, and then take every batch in turn:
+    size_t threads = 1;
+    if (flags & parallel_parse)
+        threads = std::min<size_t>(std::thread::hardware_concurrency(),
+            records.size() / min_parse_slice);
+    worker_pool pool(threads);
+
+    time_t now = time(nullptr);
+    bool lazy = !!backing;
+    bool verify = flags & verify_txids;
+    reserve(records.size(), 0, 0);
+    for (size_t first = 0; first < records.size(); first += parse_batch)
+    {
+        size_t count = std::min(parse_batch, records.size() - first);
+        std::vector<loaded_row> batch(count);
+        std::atomic<bool> valid(true);
+        auto decode = [&](size_t begin, size_t end)
+        {
+            // Arenas are not thread-safe, so each slice gets its own:
+            row_allocator allocator(std::make_shared<row_arena>());
+            for (size_t i = begin; i < end && valid; ++i)
+                if (!decode_row(records[first + i], batch[i], now, lazy,
+                    verify, allocator))
+                    valid = false;
+        };
+        pool.run(count, min_parse_slice, decode);
+        if (!valid)
+            return false;
+
+        for (auto& loaded: batch)
+            add_row(loaded.hash, loaded.row, std::move(loaded.tx), lazy);
+    }
+
+    backing_ = std::move(backing);
+    return true;
+}
+
+/**
+ * Decodes a row, and hashes it unless the file gave the hash and
+ * `verify` is off. This touches nothing but `out` and `allocator`, so
+ * rows can be decoded on many threads.
+ */
+bool tx_table::decode_row(const row_record& record, loaded_row& out,
+    time_t now, bool lazy, bool verify, const row_allocator& allocator)
+{
+    try
+    {
+        out.tx = new_tx(allocator, lazy);
+        bc::satoshi_load(record.raw, record.raw + record.raw_size, *out.tx);
+        if (satoshi_raw_size(*out.tx) != record.raw_size)
+            return false;
+    }
+    catch (bc::end_of_stream)
+    {
+        return false;
+    }
+    out.hash = record.hash;
+    if (record.hash == bc::null_hash || verify)
+    {
+        out.hash = bc::hash_transaction(*out.tx);
+        if (record.hash != bc::null_hash && record.hash != out.hash)
+            return false;
+    }
+
+    // The state has room for a value that is not one:
+    uint8_t state = record.flags & row_state_mask;
+    if (!is_tx_state(state))
+        return false;
+
+    auto& row = out.row;
+    row.raw = record.raw;
+    row.raw_size = record.raw_size;
+    row.state = static_cast<tx_state>(state);
+    row.block_height = record.height;
+    row.timestamp = now;
+    if (tx_state::unconfirmed == row.state)
+        row.timestamp = record.height;
+    row.block_hash = record.block_hash;
+    row.need_check = record.flags & row_need_check;
+    row.extract_addresses(*out.tx, allocator);
+    return true;
+}
+
+/**
+ * A transaction to decode a row into while loading. Lazy rows only
+ * need theirs for a moment, so it is not worth a place in the arena.
+ */
+std::shared_ptr<bc::transaction_type> tx_table::new_tx(
+    const row_allocator& allocator, bool lazy)
+{
+    if (lazy)
+        return std::make_shared<bc::transaction_type>();
+    return std::allocate_shared<bc::transaction_type>(allocator);
+}
+
+/**
+ * Adds a freshly-loaded row, unless a row with the same hash is already
+ * present. The row arrives with its addresses extracted and the
+ * location of its raw transaction filled in. Lazy rows keep only that
+ * location, while the others keep the decoded transaction instead.
+ */
+void tx_table::add_row(bc::hash_digest tx_hash, tx_row& row,
+    std::shared_ptr<const bc::transaction_type> tx, bool lazy)
+{
+    if (rows_.find(tx_hash) != rows_.end())
+        return;
+
+    // Index the row while the transaction is at hand:
+    if (!lazy)
+    {
+        row.raw = nullptr;
+        row.raw_size = 0;
+    }
+    auto& slot = rows_[tx_hash] = std::move(row);
+    index_tx(tx_hash, slot, *tx);
+    index_state(tx_hash, slot);
+    if (!lazy)
+        slot.tx = std::move(tx);
+}
+
+/**
+ * Moves a row to a new state, keeping the indices and balances in step.
+ */
+void tx_table::set_state(bc::hash_digest tx_hash, tx_row& row,
+    tx_state state, size_t block_height)
+{
+    unindex_state(tx_hash, row);
+    credit_outputs(tx_hash, row, false);
+
+    // A row knocked back out of a block has gone unseen only since
+    // then, or a reorg would leave it due to expire at once:
+    if (state != row.state && tx_state::confirmed != state)
+        row.timestamp = time(nullptr);
+    row.state = state;
+    row.block_height = block_height;
+    row.block_hash = bc::null_hash;
+    if (tx_state::confirmed == state)
+        row.block_hash = header_hash(block_height);
+    row.need_check = false;
+    index_state(tx_hash, row);
+    credit_outputs(tx_hash, row, true);
+}
+
+/**
+ * The hash of the block at `height`, or the null hash if that block is
+ * not among the recent ones.
+ */
+bc::hash_digest tx_table::header_hash(size_t height) const
+{
+    auto i = headers_.find(height);
+    if (i == headers_.end())
+        return bc::null_hash;
+    return i->second;
+}
+
+/**
+ * Records the hash of the block at `height`, rolling back the rows of
+ * any different block it replaces. Only the blocks within
+ * `header_depth` of the highest one are kept, which bounds how deep a
+ * reorg can be undone.
+ */
+void tx_table::set_header(size_t height, bc::hash_digest block_hash)
+{
+    auto old = header_hash(height);
+    headers_[height] = block_hash;
+    if (old != block_hash)
+        rollback(height);
+
+    auto top = headers_.rbegin()->first;
+    while (headers_.begin()->first + header_depth <= top)
+        headers_.erase(headers_.begin());
+}
+
+/**
+ * The block at `height` has a new hash. Rows confirmed in some other
+ * block at that height go back to unconfirmed, so the updater asks the
+ * server about them again. Rows confirmed before any header for that
+ * height arrived take on the new hash.
+ */
+void tx_table::rollback(size_t height)
+{
+    auto i = heights_.find(height);
+    if (i == heights_.end())
+        return;
+
+    // Changing state edits the bucket, so work from a list:
+    auto block_hash = header_hash(height);
+    std::vector<bc::hash_digest> stale;
+    for (auto& tx_hash: i->second)
+    {
+        auto j = rows_.find(tx_hash);
+        BITCOIN_ASSERT(j != rows_.end());
+        auto& row = j->second;
+        if (row.block_hash == bc::null_hash)
+            row.block_hash = block_hash;
+        else if (row.block_hash != block_hash)
+            stale.push_back(tx_hash);
+    }
+    for (auto& tx_hash: stale)
+    {
+        auto& row = rows_.find(tx_hash)->second;
+        set_state(tx_hash, row, tx_state::unconfirmed, row.block_height);
+    }
+}
+
+/**
+ * It is possible that the blockchain has forked. Therefore, mark all
+ * transactions just below the given height as needing to be checked.
+ */
+void tx_table::check_fork(size_t height)
+{
+    // Find the height of next-lower block that has transactions in it:
+    auto i = heights_.lower_bound(height);
+    if (i == heights_.begin())
+        return;
+    --i;
+
+    // Mark all transactions at that level as needing checked:
+    for (auto& tx_hash: i->second)
+    {
+        auto j = rows_.find(tx_hash);
+        BITCOIN_ASSERT(j != rows_.end());
+        j->second.need_check = true;
+        forked_.insert(tx_hash);
+    }
+}
+
+/**
+ * Files a transaction under its state,
+ * and under its block height if it is confirmed.
+ */
+void tx_table::index_state(bc::hash_digest tx_hash, const tx_row& row)
+{
+    switch (row.state)
+    {
+    case tx_state::unsent:
+        unsent_.insert(tx_hash);
+        expiry_.insert(std::make_pair(row.timestamp, tx_hash));
+        break;
+    case tx_state::unconfirmed:
+        unconfirmed_.insert(tx_hash);
+        expiry_.insert(std::make_pair(row.timestamp, tx_hash));
+        break;
+    case tx_state::confirmed:
+        heights_[row.block_height].insert(tx_hash);
+        if (row.need_check)
+            forked_.insert(tx_hash);
+        break;
+    }
+    index_history(tx_hash, row, true);
+}
+
+/**
+ * Removes a transaction from the lists it was filed under.
+ */
+void tx_table::unindex_state(bc::hash_digest tx_hash, const tx_row& row)
+{
+    switch (row.state)
+    {
+    case tx_state::unsent:
+        unsent_.erase(tx_hash);
+        expiry_.erase(std::make_pair(row.timestamp, tx_hash));
+        break;
+    case tx_state::unconfirmed:
+        unconfirmed_.erase(tx_hash);
+        expiry_.erase(std::make_pair(row.timestamp, tx_hash));
+        break;
+    case tx_state::confirmed:
+        {
+            forked_.erase(tx_hash);
+            auto i = heights_.find(row.block_height);
+            if (i == heights_.end())
+                break;
+            i->second.erase(tx_hash);
+            if (i->second.empty())
+                heights_.erase(i);
+        }
+        break;
+    }
+    index_history(tx_hash, row, false);
+}
+
+/**
+ * The height a row sorts under in address histories. Only confirmed
+ * rows have a meaningful block height.
+ */
+size_t tx_table::history_height(const tx_row& row)
+{
+    if (tx_state::confirmed != row.state)
+        return 0;
+    return row.block_height;
+}
+
+/**
+ * Files a transaction in the history of each address it touches, or
+ * takes it out again. The history is keyed by height, so this happens
+ * along with the state indices.
+ */
+void tx_table::index_history(bc::hash_digest tx_hash, const tx_row& row,
+    bool add)
+{
+    auto entry = std::make_pair(history_height(row), tx_hash);
+    auto file = [&](const script_address& use)
+    {
+        if (!use.valid)
+            return;
+        if (add)
+        {
+            history_[use.address].insert(entry);
+            return;
+        }
+        auto i = history_.find(use.address);
+        if (i == history_.end())
+            return;
+        i->second.erase(entry);
+        if (i->second.empty())
+            history_.erase(i);
+    };
+    for (auto& use: row.input_addresses)
+        file(use);
+    for (auto& use: row.output_addresses)
+        file(use);
+}
+
+/**
+ * Returns the row's transaction, decoding it from the backing store
+ * if it was loaded lazily.
+ */
+std::shared_ptr<const bc::transaction_type> tx_table::tx_row::decode() const
+{
+    if (tx)
+        return tx;
+
+    auto out = std::make_shared<bc::transaction_type>();
+    bc::satoshi_load(raw, raw + raw_size, *out);
+    return out;
+}
+
+/**
+ * Copies out one output of the row's transaction. Lazy rows skip over
+ * the rest of the raw transaction instead of decoding all of it.
+ * Returns false if there is no such output.
+ */
+bool tx_table::tx_row::decode_output(uint32_t index,
+    bc::transaction_output_type& out) const
+{
+    if (tx)
+    {
+        if (tx->outputs.size() <= index)
+            return false;
+        out = tx->outputs[index];
+        return true;
+    }
+
+    const uint8_t* end = raw + raw_size;
+    auto serial = bc::make_deserializer(raw, end);
+    auto outputs = skip_inputs(serial, end);
+    if (outputs <= index)
+        return false;
+    for (uint32_t i = 0; i < index; ++i)
+        skip_output(serial, end);
+    out.value = serial.read_8_bytes();
+    auto script_size = serial.read_variable_uint();
+    out.script = bc::parse_script(serial.read_data(script_size));
+    return true;
+}
+
+size_t tx_table::tx_row::tx_size() const
+{
+    if (tx)
+        return satoshi_raw_size(*tx);
+    return raw_size;
+}
+
+/**
+ * Decodes the address in each input and output script.
+ */
+void tx_table::tx_row::extract_addresses(const bc::transaction_type& tx,
+    const row_allocator& allocator)
+{
+    input_addresses = script_address_list(tx.inputs.size(),
+        script_address(), allocator);
+    for (size_t i = 0; i < tx.inputs.size(); ++i)
+        input_addresses[i].valid =
+            bc::extract(input_addresses[i].address, tx.inputs[i].script);
+
+    output_addresses = script_address_list(tx.outputs.size(),
+        script_address(), allocator);
+    for (size_t i = 0; i < tx.outputs.size(); ++i)
+        output_addresses[i].valid =
+            bc::extract(output_addresses[i].address, tx.outputs[i].script);
+}
+
+/**
+ * Adds a transaction's inputs and outputs to the address index
+ * and the unspent output set.
+ */
+void tx_table::index_tx(bc::hash_digest tx_hash, const tx_row& row,
+    const bc::transaction_type& tx)
+{
+    for (uint32_t i = 0; i < tx.inputs.size(); ++i)
+    {
+        auto& input = row.input_addresses[i];
+        if (input.valid)
+            addresses_[input.address].push_back(address_use{tx_hash, i, true});
+
+        auto& point = tx.inputs[i].previous_output;
+        if (is_null_point(point))
+            continue;
+        if (add_spender(point, tx_hash))
+            remove_utxo(point);
+    }
+    for (uint32_t i = 0; i < tx.outputs.size(); ++i)
+    {
+        auto& output = row.output_addresses[i];
+        if (output.valid)
+            addresses_[output.address].push_back(
+                address_use{tx_hash, i, false});
+
+        // A spending transaction may have arrived first:
+        bc::output_point point = {tx_hash, i};
+        if (spends_.find(point) == spends_.end())
+            add_utxo(point, tx.outputs[i].value, row);
+    }
+}
+
+/**
+ * Removes a transaction's entries from the address index,
+ * and returns any outputs it was spending to the unspent output set.
+ * The transaction must still be in the database when this is called.
+ */
+void tx_table::unindex_tx(bc::hash_digest tx_hash, const tx_row& row)
+{
+    auto unindex = [this, &tx_hash](const script_address& entry)
+    {
+        if (!entry.valid)
+            return;
+        auto i = addresses_.find(entry.address);
+        if (i == addresses_.end())
+            return;
+
+        auto& uses = i->second;
+        uses.erase(std::remove_if(uses.begin(), uses.end(),
+            [&tx_hash](const address_use& use)
+            {
+                return use.tx_hash == tx_hash;
+            }), uses.end());
+        if (uses.empty())
+            addresses_.erase(i);
+    };
+
+    auto decoded = row.decode();
+    const auto& tx = *decoded;
+    for (uint32_t i = 0; i < tx.inputs.size(); ++i)
+    {
+        unindex(row.input_addresses[i]);
+
+        auto& point = tx.inputs[i].previous_output;
+        if (is_null_point(point) || !remove_spender(point, tx_hash))
+            continue;
+
+        // The output is now unspent, if we have it:
+        auto k = rows_.find(point.hash);
+        if (k == rows_.end())
+            continue;
+        bc::transaction_output_type output;
+        if (k->second.decode_output(point.index, output))
+            add_utxo(point, output.value, k->second);
+    }
+    for (uint32_t i = 0; i < tx.outputs.size(); ++i)
+    {
+        unindex(row.output_addresses[i]);
+        remove_utxo(bc::output_point{tx_hash, i});
+    }
+}
+
+/**
+ * Adds an output to the unspent set, and its value to the balance of
+ * the address it pays. `row` is the transaction it belongs to.
+ */
+void tx_table::add_utxo(const bc::output_point& point, uint64_t value,
+    const tx_row& row)
+{
+    utxos_[point] = value;
+    adjust_balance(row, point.index, value, true);
+}
+
+/**
+ * Takes an output out of the unspent set, if it is there, along with
+ * its value from the balance of the address it pays.
+ */
+void tx_table::remove_utxo(const bc::output_point& point)
+{
+    auto i = utxos_.find(point);
+    if (i == utxos_.end())
+        return;
+
+    auto j = rows_.find(point.hash);
+    BITCOIN_ASSERT(j != rows_.end());
+    adjust_balance(j->second, point.index, i->second, false);
+    utxos_.erase(i);
+}
+
+/**
+ * Records that `tx_hash` spends an output. Returns true if nothing in
+ * the database spent it before.
+ */
+bool tx_table::add_spender(const bc::output_point& point,
+    bc::hash_digest tx_hash)
+{
+    auto i = spends_.find(point);
+    if (i == spends_.end())
+    {
+        spends_[point] = tx_hash;
+        return true;
+    }
+
+    // Double spends are rare, so they live off to the side:
+    conflicts_[point].push_back(tx_hash);
+    return false;
+}
+
+/**
+ * Forgets that `tx_hash` spends an output. Returns true if nothing in
+ * the database spends it anymore.
+ */
+bool tx_table::remove_spender(const bc::output_point& point,
+    bc::hash_digest tx_hash)
+{
+    auto i = spends_.find(point);
+    BITCOIN_ASSERT(i != spends_.end());
+    auto j = conflicts_.find(point);
+    if (j == conflicts_.end())
+    {
+        spends_.erase(i);
+        return true;
+    }
+
+    // Promote another spender if this was the main one:
+    auto& others = j->second;
+    if (i->second == tx_hash)
+    {
+        i->second = others.back();
+        others.pop_back();
+    }
+    else
+    {
+        auto k = std::find(others.begin(), others.end(), tx_hash);
+        BITCOIN_ASSERT(k != others.end());
+        others.erase(k);
+    }
+    if (others.empty())
+        conflicts_.erase(j);
+    return false;
+}
+
+/**
+ * Adds or subtracts a transaction's unspent outputs from the balances,
+ * so they can move between confirmed and unconfirmed as its state
+ * changes.
+ */
+void tx_table::credit_outputs(bc::hash_digest tx_hash, const tx_row& row,
+    bool credit)
+{
+    for (uint32_t i = 0; i < row.output_addresses.size(); ++i)
+    {
+        auto j = utxos_.find(bc::output_point{tx_hash, i});
+        if (j != utxos_.end())
+            adjust_balance(row, i, j->second, credit);
+    }
+}
+
+void tx_table::adjust_balance(const tx_row& row, uint32_t index,
+    uint64_t value, bool credit)
+{
+    auto& output = row.output_addresses[index];
+    if (!output.valid)
+        return;
+
+    auto& balance = balances_[output.address];
+    auto& total = tx_state::confirmed == row.state ?
+        balance.confirmed : balance.unconfirmed;
+    if (credit)
+        total += value;
+    else
+        total -= value;
+    if (!balance.confirmed && !balance.unconfirmed)
+        balances_.erase(output.address);
+}
+
+} // libwallet
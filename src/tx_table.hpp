@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2011-2014 libbitcoin developers (see AUTHORS)
+ *
+ * This file is part of libbitcoin-watcher.
+ *
+ * libbitcoin-watcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LIBBITCOIN_WATCHER_TX_TABLE_HPP
+#define LIBBITCOIN_WATCHER_TX_TABLE_HPP
+
+#include <bitcoin/watcher/tx_db.hpp>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include "flat_map.hpp"
+#include "row_arena.hpp"
+
+namespace libwallet {
+
+/**
+ * True if a byte read back from a file or a journal names a tx_state.
+ */
+inline bool is_tx_state(uint8_t value)
+{
+    return value <= static_cast<uint8_t>(tx_state::confirmed);
+}
+
+/**
+ * The rows of a transaction database, along with their indices.
+ *
+ * This class does no locking of its own. The tx_db class guards the
+ * live copy, and snapshots share copies that nobody changes anymore.
+ */
+class tx_table
+{
+public:
+    tx_table();
+
+    // - Queries: ----------------------
+    size_t last_height() const;
+    bool has_tx(bc::hash_digest tx_hash) const;
+    bc::transaction_type get_tx(bc::hash_digest tx_hash) const;
+    std::shared_ptr<const bc::transaction_type> find_tx(
+        bc::hash_digest tx_hash) const;
+    bool get_output(const bc::output_point& point,
+        bc::transaction_output_type& out) const;
+    size_t get_tx_height(bc::hash_digest tx_hash) const;
+    bool is_spend(bc::hash_digest tx_hash,
+        const address_set& addresses) const;
+    bool has_history(const bc::payment_address& address) const;
+    std::vector<bc::hash_digest> get_address_txs(
+        const bc::payment_address& address) const;
+    history_list get_history(const bc::payment_address& address,
+        size_t from_height, size_t limit, bc::hash_digest cursor) const;
+    bc::hash_digest get_spender(const bc::output_point& point) const;
+    std::vector<bc::hash_digest> get_conflicts(bc::hash_digest tx_hash) const;
+    bc::output_info_list get_utxos() const;
+    bc::output_info_list get_utxos(const address_set& addresses) const;
+    address_balance get_balance(const address_set& addresses) const;
+    bc::data_chunk serialize(unsigned flags) const;
+
+    /**
+     * Writes the same bytes as `serialize` to a stream, a chunk of rows
+     * at a time, without building the whole blob in memory first.
+     */
+    void serialize(std::ostream& out, unsigned flags) const;
+
+    /**
+     * Compresses the rows of an uncompressed blob from `serialize`.
+     * This works from the blob alone, so needs no lock on the table.
+     */
+    static bc::data_chunk compress(const bc::data_chunk& blob);
+
+    void dump(std::ostream& out) const;
+    void get_sizes(tx_db_stats& out) const;
+    void export_rows(std::ostream& out, export_format format,
+        const export_filter& filter) const;
+
+    /**
+     * Lists the hashes of all rows, so they can be written out a chunk
+     * at a time, each under a lock of its own.
+     */
+    std::vector<bc::hash_digest> row_hashes() const;
+
+    /**
+     * Append the rows in `hashes` from `next` on to `out`, as `dump` or
+     * `export_rows` would write them, until a chunk's worth collects.
+     * Rows forgotten since the hashes were listed are skipped.
+     * @return the position to carry on from.
+     */
+    size_t dump_chunk(std::string& out,
+        const std::vector<bc::hash_digest>& hashes, size_t next) const;
+    size_t export_chunk(std::string& out,
+        const std::vector<bc::hash_digest>& hashes, size_t next,
+        export_format format, const export_filter& filter) const;
+
+    typedef std::function<void (bc::hash_digest tx_hash)> hash_fn;
+    void foreach_unconfirmed(const hash_fn& f) const;
+    void foreach_forked(const hash_fn& f) const;
+
+    typedef std::function<void (const bc::transaction_type& tx)> tx_fn;
+    void foreach_unsent(const tx_fn& f) const;
+
+    // - Changes: ----------------------
+
+    /**
+     * Fills an empty table from a serialized blob.
+     * If `backing` is set, it must own the blob. The rows then point
+     * into the blob instead of holding decoded transactions, and keep
+     * `backing` alive.
+     */
+    bool load(const uint8_t* data, size_t size,
+        std::shared_ptr<const void> backing=nullptr, unsigned flags=0);
+
+    /**
+     * Makes room for `count` more rows, spending and creating `inputs`
+     * and `outputs` outputs in all.
+     */
+    void reserve(size_t count, size_t inputs, size_t outputs);
+
+    // These return true if the change of the same name would change
+    // anything, so that a shared table need not be copied for nothing:
+    bool would_confirm(bc::hash_digest tx_hash, size_t block_height) const;
+    bool would_unconfirm(bc::hash_digest tx_hash) const;
+    bool would_reset_timestamp(bc::hash_digest tx_hash) const;
+
+    // These return true if they changed anything:
+    bool insert(const bc::transaction_type& tx, tx_state state);
+    bool insert(const bc::transaction_type& tx, bc::hash_digest tx_hash,
+        tx_state state);
+    bool at_height(size_t height);
+    bool confirmed(bc::hash_digest tx_hash, size_t block_height);
+    bool unconfirmed(bc::hash_digest tx_hash);
+    bool forget(bc::hash_digest tx_hash);
+    void reset_timestamp(bc::hash_digest tx_hash);
+
+    /**
+     * Forgets the unsent and unconfirmed rows that have gone unseen for
+     * more than `timeout` seconds as of `now`, returning their hashes.
+     */
+    bool has_expired(time_t now, unsigned timeout) const;
+    std::vector<bc::hash_digest> expire(time_t now, unsigned timeout);
+
+    /**
+     * Records the hash of the block at `height`, along with the hash of
+     * its parent. Rows confirmed in any block this replaces go back to
+     * unconfirmed. Returns true until the parent matches a known block,
+     * in which case the block below it may have changed too, as long
+     * as older blocks are known to compare against.
+     */
+    bool add_header(size_t height, bc::hash_digest block_hash,
+        bc::hash_digest previous);
+
+private:
+    void check_fork(size_t height);
+    struct tx_row;
+    void set_state(bc::hash_digest tx_hash, tx_row& row, tx_state state,
+        size_t block_height);
+    bc::hash_digest header_hash(size_t height) const;
+    void set_header(size_t height, bc::hash_digest block_hash);
+    void rollback(size_t height);
+    void index_tx(bc::hash_digest tx_hash, const tx_row& row,
+        const bc::transaction_type& tx);
+    void unindex_tx(bc::hash_digest tx_hash, const tx_row& row);
+    void index_state(bc::hash_digest tx_hash, const tx_row& row);
+    void unindex_state(bc::hash_digest tx_hash, const tx_row& row);
+    static size_t history_height(const tx_row& row);
+    void index_history(bc::hash_digest tx_hash, const tx_row& row,
+        bool add);
+    void add_utxo(const bc::output_point& point, uint64_t value,
+        const tx_row& row);
+    void remove_utxo(const bc::output_point& point);
+    bool add_spender(const bc::output_point& point, bc::hash_digest tx_hash);
+    bool remove_spender(const bc::output_point& point,
+        bc::hash_digest tx_hash);
+    void credit_outputs(bc::hash_digest tx_hash, const tx_row& row,
+        bool credit);
+    void adjust_balance(const tx_row& row, uint32_t index, uint64_t value,
+        bool credit);
+
+    // Serialization:
+    static uint64_t saved_height(const tx_row& row);
+    static size_t row_size(const tx_row& row);
+    size_t payload_size() const;
+    size_t header_size() const;
+    uint8_t* write_header(uint8_t* out) const;
+    static uint8_t* write_row(uint8_t* out, const tx_row& row);
+    typedef std::function<void (const uint8_t* data, size_t size)> sink_fn;
+    void write_rows(const sink_fn& sink) const;
+    static void dump_row(std::string& out, bc::hash_digest tx_hash,
+        const tx_row& row);
+    static void export_row(std::string& out, bc::hash_digest tx_hash,
+        const tx_row& row, export_format format);
+    static bool exported(const tx_row& row, const export_filter& filter);
+    static bool confirm_changes(const tx_row& row, size_t block_height);
+    static bool unconfirm_changes(const tx_row& row);
+    static void write_json(std::string& out, bc::hash_digest tx_hash,
+        const tx_row& row);
+    typedef arena_allocator<uint8_t> row_allocator;
+    struct row_record;
+    struct loaded_row;
+    bool load_v1(const uint8_t* data, const uint8_t* end,
+        std::shared_ptr<const void> backing, unsigned flags);
+    bool load_v2(const uint8_t* data, const uint8_t* end,
+        std::shared_ptr<const void> backing, unsigned flags);
+    bool load_rows(const std::vector<row_record>& records,
+        std::shared_ptr<const void> backing, unsigned flags);
+    static bool decode_row(const row_record& record, loaded_row& out,
+        time_t now, bool lazy, bool verify, const row_allocator& allocator);
+    static std::shared_ptr<bc::transaction_type> new_tx(
+        const row_allocator& allocator, bool lazy);
+    void add_row(bc::hash_digest tx_hash, tx_row& row,
+        std::shared_ptr<const bc::transaction_type> tx, bool lazy);
+
+    // The last block seen on the network:
+    size_t last_height_;
+
+    /**
+     * The address an input or output script refers to, if any.
+     */
+    struct script_address
+    {
+        bool valid;
+        bc::payment_address address;
+    };
+    typedef std::vector<script_address, arena_allocator<script_address>>
+        script_address_list;
+
+    /**
+     * A single row in the transaction database.
+     */
+    struct tx_row
+    {
+        // The transaction itself. Rows loaded lazily leave this empty,
+        // and point at the raw transaction in the backing store instead:
+        std::shared_ptr<const bc::transaction_type> tx;
+        const uint8_t* raw;
+        size_t raw_size;
+        std::shared_ptr<const bc::transaction_type> decode() const;
+        bool decode_output(uint32_t index,
+            bc::transaction_output_type& out) const;
+        size_t tx_size() const;
+
+        // The addresses in each input and output, decoded once:
+        script_address_list input_addresses;
+        script_address_list output_addresses;
+        void extract_addresses(const bc::transaction_type& tx,
+            const row_allocator& allocator);
+
+        // State machine:
+        tx_state state;
+        size_t block_height;
+        time_t timestamp;
+
+        // The block the transaction was confirmed in, if its header was
+        // among the recent ones at the time. Otherwise the null hash:
+        bc::hash_digest block_hash;
+
+        // The transaction is certainly in a block, but there is some
+        // question whether or not that block is on the main chain:
+        bool need_check;
+    };
+
+public:
+    // The map the rows live in, public so that benchmarks can weigh it
+    // with the real row type:
+    typedef flat_map<bc::hash_digest, tx_row, digest_hash> row_map;
+
+private:
+    row_map rows_;
+
+    /**
+     * A row of a saved file, found but not yet decoded. The compact
+     * format stores no hash, leaving it null, and its row flags, which
+     * rows of the original format are translated into.
+     */
+    struct row_record
+    {
+        bc::hash_digest hash;
+        uint8_t flags;
+        uint64_t height;
+        bc::hash_digest block_hash;
+        const uint8_t* raw;
+        size_t raw_size;
+    };
+
+    /**
+     * A row decoded while loading, waiting to be merged into the table.
+     */
+    struct loaded_row
+    {
+        bc::hash_digest hash;
+        tx_row row;
+        std::shared_ptr<bc::transaction_type> tx;
+    };
+
+    // Owns the raw transactions of lazily-loaded rows:
+    std::shared_ptr<const void> backing_;
+
+    // The hashes of the most recent blocks, by height:
+    std::map<size_t, bc::hash_digest> headers_;
+
+    // The confirmed transactions in each block, ordered by height:
+    std::map<size_t, std::unordered_set<bc::hash_digest>> heights_;
+
+    // The rows in each state, so the updater's loops only visit the
+    // rows they care about:
+    std::unordered_set<bc::hash_digest> unsent_;
+    std::unordered_set<bc::hash_digest> unconfirmed_;
+    std::unordered_set<bc::hash_digest> forked_;
+
+    // The unsent and unconfirmed rows, oldest timestamp first:
+    std::set<std::pair<time_t, bc::hash_digest>> expiry_;
+
+    /**
+     * A place where an address appears in a transaction.
+     */
+    struct address_use
+    {
+        bc::hash_digest tx_hash;
+        uint32_t index;
+        bool input;
+    };
+    std::unordered_map<bc::payment_address, std::vector<address_use>>
+        addresses_;
+
+    // The transactions touching each address, ordered by height and
+    // then by hash, for paging through:
+    typedef std::set<std::pair<size_t, bc::hash_digest>> history_set;
+    std::unordered_map<bc::payment_address, history_set> history_;
+
+    // The transaction in the database spending each output:
+    flat_map<bc::output_point, bc::hash_digest, point_hash> spends_;
+
+    // Any further transactions spending the same outputs:
+    std::unordered_map<bc::output_point, std::vector<bc::hash_digest>,
+        point_hash> conflicts_;
+
+    // Outputs that no transaction in the database spends, with values:
+    flat_map<bc::output_point, uint64_t, point_hash> utxos_;
+
+    // The value of the above outputs, totalled by address. Addresses
+    // with nothing left are dropped:
+    std::unordered_map<bc::payment_address, address_balance> balances_;
+};
+
+} // namespace libwallet
+
+#endif
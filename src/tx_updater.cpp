@@ -43,8 +43,7 @@ void tx_updater::start()
     get_height();
 
     // Handle block-fork checks & unconfirmed transactions:
-    db_.foreach_unconfirmed(std::bind(&tx_updater::get_index, this, _1));
-    queue_get_indices();
+    check_unconfirmed();
 
     // Transmit all unsent transactions:
     db_.foreach_unsent(std::bind(&tx_updater::send_tx, this, _1));
@@ -85,6 +84,7 @@ bc::client::sleep_time tx_updater::wakeup()
     if (period <= elapsed)
     {
         get_height();
+        db_.expire(time(nullptr));
         last_wakeup_ = now;
         elapsed = bc::client::sleep_time::zero();
     }
@@ -122,7 +122,7 @@ void tx_updater::watch(bc::hash_digest tx_hash, bool want_inputs)
     if (!db_.has_tx(tx_hash))
         get_tx(tx_hash, want_inputs);
     else if (want_inputs)
-        get_inputs(db_.get_tx(tx_hash));
+        db_.with_tx(tx_hash, std::bind(&tx_updater::get_inputs, this, _1));
 }
 
 void tx_updater::get_inputs(const bc::transaction_type& tx)
@@ -145,6 +145,12 @@ void tx_updater::queue_get_indices()
     db_.foreach_forked(std::bind(&tx_updater::get_index, this, _1));
 }
 
+void tx_updater::check_unconfirmed()
+{
+    db_.foreach_unconfirmed(std::bind(&tx_updater::get_index, this, _1));
+    queue_get_indices();
+}
+
 // - server queries --------------------
 
 void tx_updater::get_height()
@@ -162,15 +168,36 @@ void tx_updater::get_height()
             db_.at_height(height);
             callbacks_.on_height(height);
 
-            // Query all unconfirmed transactions:
-            db_.foreach_unconfirmed(std::bind(&tx_updater::get_index, this, _1));
-            queue_get_indices();
+            // Check for a reorg before querying unconfirmed transactions,
+            // so any that the reorg knocks out get queried too:
+            get_header(height);
         }
     };
 
     codec_.fetch_last_height(on_error, on_done);
 }
 
+void tx_updater::get_header(size_t height)
+{
+    auto on_error = [this](const std::error_code& error)
+    {
+        (void)error;
+        failed_ = true;
+        check_unconfirmed();
+    };
+
+    auto on_done = [this, height](const bc::block_header_type& header)
+    {
+        // Walk down the chain until it meets a block we already know:
+        if (db_.add_header(height, header))
+            get_header(height - 1);
+        else
+            check_unconfirmed();
+    };
+
+    codec_.fetch_block_header(on_error, on_done, height);
+}
+
 void tx_updater::get_tx(bc::hash_digest tx_hash, bool want_inputs)
 {
     ++queued_queries_;